@@ -7,7 +7,7 @@ call "C:\Program Files (x86)\Microsoft Visual Studio\2022\BuildTools\VC\Auxiliar
 echo Building normalize.exe with MSVC...
 echo.
 
-cl /W3 /O2 /Fenormalize.exe normalize.c PCMWAV.C kernel32.lib
+cl /W3 /O2 /Fenormalize.exe normalize.c PCMWAV.C THREADS.C KERNELS.C LOUDNESS.C CACHE.C kernel32.lib
 
 if %ERRORLEVEL% EQU 0 (
     echo.
@@ -3,7 +3,7 @@ REM Build script for normalize.exe with LUFS support
 REM Requires Microsoft Visual C++ compiler (cl.exe) in PATH
 
 echo Building normalize.exe...
-cl /W3 /O2 /Fenormalize.exe normalize.c PCMWAV.C kernel32.lib
+cl /W3 /O2 /Fenormalize.exe normalize.c PCMWAV.C THREADS.C KERNELS.C LOUDNESS.C CACHE.C kernel32.lib
 
 if %ERRORLEVEL% EQU 0 (
     echo.
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Build script for normalize on Linux/macOS
+# Requires a C compiler (cc) in PATH
+
+echo "Building normalize..."
+# (-x c: the upper-case .C files are C, not C++)
+${CC:-cc} -Wall -O2 -o normalize -x c normalize.c PCMWAV.C THREADS.C KERNELS.C LOUDNESS.C CACHE.C -lm -lpthread
+
+if [ $? -eq 0 ]; then
+    echo
+    echo "Build successful! normalize created."
+    echo
+    echo "Try: ./normalize -h"
+else
+    echo
+    echo "Build failed! Make sure a C compiler is available."
+    exit 1
+fi
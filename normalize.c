@@ -30,41 +30,175 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <io.h>
-#include <windows.h>
+#include <string.h>
+#include <stdarg.h>
 #include <math.h>
-#include <stdlib.h>
 #include <time.h>
-#include "pcmwav.h"
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <glob.h>
+#endif
+#include "PCMWAV.H"
+#include "THREADS.H"
+#include "KERNELS.H"
+#include "LOUDNESS.H"
+#include "CACHE.H"
+
+#ifndef _WIN32
+// POSIX stand-ins for the Win32 memory calls (VirtualAlloc memory comes zeroed)
+#define MEM_COMMIT			0
+#define MEM_RELEASE			0
+#define PAGE_READWRITE		0
+#define VirtualAlloc(addr, size, type, protect)		calloc(1, (size))
+#define VirtualFree(addr, size, type)				free(addr)
+#endif
+
+#define MAPVIEWSIZE			16777216	// minimum view size for memory-mapped I/O
+#define NPIPEBUFS			3			// buffers rotating through the amplify pipeline
+#define KERNELBLOCK			4096		// samples unpacked at a time by the 24-bit passes
+#define NSTATHIST			4			// interleaved smartpeak sub-histograms
+#define MAXTHREADS			64			// most worker threads for -j
+#define SEGMINSUB			100			// fewest 100 ms sub-blocks in a LUFS segment (-j)
+#define SEGMINCHUNKS		4			// fewest chunks in a peak or amplify segment (-j)
+#define WARMUPSUB			4			// sub-blocks run through the filters before a segment
+#define LUFSBLOCK			KERNELBLOCK	// samples converted at a time for the loudness meter
+#define REGIONSUB			10			// 100 ms sub-blocks in each region measured by -e
+#define DITHERBLOCK			65536		// frames between restarts of the -D noise shaping
 
 #define COPYRIGHT_NOTICE	"normalize v1.0.1 (c) 2000-2004 Manuel Kasper <mk@neon1.net>.\n" \
 							"All rights reserved.\n" \
 							"smartpeak code by Lapo Luchini <lapo@lapo.it>.\n" \
 							"LUFS support and watch mode added 2025 by Cam St Clair with Claude (Anthropic)."
 
-// Biquad filter structure for K-weighting
+// Peak levels found by analyze()
+typedef struct {
+	double			minpeak, maxpeak;	// extreme sample values (1.0 = full scale for float)
+	unsigned long long	*stats;			// NSTATHIST smartpeak sub-histograms while scanning, else NULL
+	unsigned long long	numstat;		// samples counted in stats
+	double			truepeak;			// 4x oversampled peak with -t (1.0 = full scale)
+	int				estimated;			// only regions of the file were read (-e)
+	double			lufs_below, lufs_above;	// estimates: LU from the loudness down and up to the ends of its 95% interval (< 0 if unknown)
+} analysis;
+
+// One buffer of the amplify pipeline ring
+typedef struct {
+	char			*data;		// slotsize bytes
+	unsigned long long	pos;	// data offset of the chunk held
+	unsigned long	len;		// number of bytes held
+} pipe_slot;
+
+// Noise shaping state of the -D requantizer along a run of consecutive
+// chunks (see requantize())
 typedef struct {
-	double b0, b1, b2;  // Numerator coefficients
-	double a1, a2;      // Denominator coefficients (a0 is always 1)
-	double z1, z2;      // State variables
-} biquad_filter;
+	unsigned long long	next;	// data offset at which the run carries on
+	double			*err;		// last requantization error of every channel
+} dither_state;
 
-// K-weighting filter pair (ITU-R BS.1770-4)
+// One file of a batch (see run_batch())
 typedef struct {
-	biquad_filter shelf;     // High-shelf pre-filter (~4kHz, +4dB)
-	biquad_filter highpass;  // High-pass RLB filter (~38Hz)
-} k_weighting;
-
-void			*buf;
-unsigned char	*buf8;
-unsigned short	*buf16;
-signed char		*table8;
-signed short	*table16;
+	char			*fname;
+	int				missing;	// 1: no file matched this argument, 2: only directories did
+	volatile int	result;
+	volatile int	done;
+	char			*log;		// what processing the file printed
+} batch_file;
+
+// The files named on the command line, in the order they are processed
+typedef struct {
+	batch_file		*file;
+	int				nfiles, size;
+	int				next;		// first file no worker has taken yet
+	int				nreported;	// files whose messages have been printed
+	int				stop;		// a file failed; don't start any more
+	mutex			lock;
+} batch;
+
+// Everything that belongs to the file being processed (see process_file()),
+// so that the worker pool of a batch can run several files at once (-j)
+typedef struct {
+	pcmwavfile		pwf;
+	pcmwavfile		outwf;
+	void			*buf;			// chunksize bytes
+	unsigned long	chunksize;
+	double			ratio;
+	int				nthreads;		// segments of the passes over this file
+	int				estimating;
+	int				limiting;		// this file goes through the limiter (-r)
+	limiter			lim;
+	unsigned char	*limitbuf;		// frames the limiter reads ahead of a chunk
+	signed char		*table8;		// the tables stay with the job from file to file
+	signed short	*table16;
+	double			table8_ratio, table16_ratio;	// ratio the tables hold (see gain_table8())
+	int				table8_ok, table16_ok;
+	int				buffered;		// messages wait in log until the files before are reported
+									// (progress percentages are left out)
+	char			*log;
+	unsigned long	loglen, logsize;
+	mutex			loglock;		// the pipeline threads report errors too
+	batch			*files;			// the batch the job works through
+} job;
+
+// One segment of a multi-threaded pass (see segpass_init())
+typedef struct {
+	unsigned long long	start, end;	// data offsets of the segment
+	analysis		an;			// peaks of the segment
+	lufs_meter		meter;		// sub-block energies of the segment
+	truepeak_meter	tp;			// true peaks of the segment
+	dither_state	ds;			// noise shaping of the segment (-D)
+	char			*mem;		// chunksize bytes to read into (NULL with -M)
+	thread			worker;
+	int				started;	// worker runs on its own thread
+	volatile int	error;
+	struct segpass	*pass;
+} segment;
+
+// Shared state of a multi-threaded analysis or amplify pass
+typedef struct segpass {
+	segment			seg[MAXTHREADS];
+	int				nsegs;
+	unsigned long long	warmup;	// bytes run through the filters before each segment
+	void			(*scan)(analysis *an, void *chunk, unsigned long len);
+	void			(*convert)(void *src, double *dst, unsigned long n);
+	void			(*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+	int				lufs, truepeak;	// segments feed their meter / true-peak meter
+	mutex			lock;		// guards ndone and nrunning
+	semaphore		tick;		// posted for every chunk done and every segment finished
+	unsigned long long	ndone;	// bytes done by all segments
+	int				nrunning;
+	job				*jb;
+} segpass;
+
+// Read/amplify/write pipeline state (see run_pipeline())
+typedef struct {
+	char			*ring;		// NPIPEBUFS * slotsize bytes
+	unsigned long	slotsize;	// iobufsize rounded down to whole sample frames
+	pipe_slot		slot[NPIPEBUFS];
+	semaphore		nfree;		// slots ready to be read into
+	semaphore		nfilled;	// slots ready to be amplified
+	semaphore		ncomputed;	// slots ready to be written
+	unsigned long	nchunks;
+	volatile int	error;
+	job				*jb;
+} pipeline;
+
 unsigned long	iobufsize = 65536;
-pcmwavfile		pwf;
-HANDLE			outf;
-double			ratio, normpercent = 100.0, peakpercent = 100.0;
+int				use_mmap = 0;
+int				nthreads = 1;
+int				noclip = 0;
+double			fixed_ratio;		// -l/-a: the ratio every file is amplified by
+double			normpercent = 100.0, peakpercent = 100.0;
 int				smartpeak = 0;
+int				truepeak_mode = 0;
+int				use_cache = 0;
+int				use_table16 = 0;
+int				dither = 0;
+int				use_limiter = 0;
+int				stream_ms = 0;		// -S: latency of the stream normalizer
+int				raw_input = 0;		// -i: the stream is raw samples in the format set in raw_format
+pcmwavfile		raw_format;
+double			estimate_percent = 0;
 double			mingain = 0;
 int				usemingain = 0;
 int				quiet = 0, nooverwrite = 0;
@@ -78,30 +212,90 @@ int				watch_mode = 0;
 char			watch_folder[1024];
 char			output_folder[1024];
 
-void make_table8(void);
-void make_table16(void);
-int getpeaks8(signed char *minpeak, signed char *maxpeak);
-int getpeaks16(signed short *minpeak, signed short *maxpeak);
-unsigned long amplify8(void);
-unsigned long amplify16(void);
-unsigned long passthrough(void);
-int process_filespec(char *fspec);
-int process_file(char *fname);
+void make_table8(job *jb);
+void make_table16(job *jb);
+int gain_table8(job *jb);
+int gain_table16(job *jb);
+void peaks8(analysis *an, void *chunk, unsigned long len);
+void peaks16(analysis *an, void *chunk, unsigned long len);
+void peaks24(analysis *an, void *chunk, unsigned long len);
+int float_bin(double cur);
+void peaks_f32(analysis *an, void *chunk, unsigned long len);
+void peaks_f64(analysis *an, void *chunk, unsigned long len);
+int analyze(job *jb, analysis *an, int peaks, lufs_meter *meter, cache_entry *ce);
+void smartpeak_levels(job *jb, analysis *an, unsigned long long *cum, unsigned long nbins);
+void cached_peaks(job *jb, analysis *an, cache_entry *ce);
+int analyze_segments(job *jb, analysis *an, lufs_meter *meter, truepeak_meter *tp, void (*scan)(analysis *an, void *chunk, unsigned long len),
+	void (*convert)(void *src, double *dst, unsigned long n), unsigned long nbins);
+void segment_worker(void *arg);
+int analyze_regions(job *jb, analysis *an, lufs_meter *meter, truepeak_meter *tp, void (*scan)(analysis *an, void *chunk, unsigned long len),
+	void (*convert)(void *src, double *dst, unsigned long n));
+segpass *segpass_init(job *jb, int nsegs, unsigned long long unit, int store);
+int segpass_run(segpass *sp, void (*worker)(void *arg), char *progress);
+void segpass_free(segpass *sp);
+void segment_tick(segpass *sp, unsigned long n, int finished);
+int amplify_segments(job *jb, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds));
+void amplify_worker(void *arg);
+unsigned long first_bin_above(unsigned long long *cum, unsigned long nbins, unsigned long long limit);
+double full_scale(job *jb);
+double peak_ratio(job *jb, analysis *an);
+void estimate_bounds(job *jb, double r, double *lo, double *hi);
+unsigned long long amplify8(job *jb);
+unsigned long long amplify16(job *jb);
+unsigned long long amplify24(job *jb);
+unsigned long long amplifyf(job *jb);
+unsigned long long passthrough(job *jb);
+void gain8(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void gain16(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void gain16_table(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void gain24(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void gainf(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void dither8(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void dither16(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void dither24(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void requantize(job *jb, int *s, unsigned long n, unsigned long long index, int lo, int hi, dither_state *ds);
+void limitk(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds);
+void limit_push(job *jb, unsigned long long from, unsigned long long to, unsigned char *p, unsigned long long first, unsigned long nframes, unsigned char *ahead, unsigned long nahead, double *gain);
+void load_scaled(job *jb, void *src, double *dst, unsigned long n);
+void store_limited(job *jb, double *src, void *dst, unsigned long n);
+unsigned long long run_amplify(job *jb, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds));
+int pipeline_init(job *jb, pipeline *pl);
+void pipeline_free(pipeline *pl);
+void pipeline_abort(pipeline *pl);
+void pipeline_reader(void *arg);
+void pipeline_writer(void *arg);
+unsigned long long run_pipeline(job *jb, pipeline *pl, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds), dither_state *ds);
+void *get_chunk(job *jb, unsigned long long pos, unsigned long len, int store, void *mem);
+int put_chunk(job *jb, void *chunk, unsigned long long pos, unsigned long len, int store);
+int batch_add(batch *b, char *fname, int missing);
+int collect_files(batch *b, char *fspec);
+int run_batch(batch *b);
+void batch_worker(void *arg);
+job *job_new(int buffered);
+void job_free(job *jb);
+void job_printf(job *jb, const char *fmt, ...);
+int process_file(job *jb, char *fname);
 void usage(void);
-void init_k_weighting(k_weighting *kw, unsigned long samplerate);
-double apply_k_weighting(k_weighting *kw, double sample);
-double calculate_lufs8(void);
-double calculate_lufs16(void);
-int compare_double(const void *a, const void *b);
-void process_existing_files(char *folder, char *outfolder);
-int watch_folder_mode(char *folder, char *outfolder);
+void to_double8(void *src, double *dst, unsigned long n);
+void to_double16(void *src, double *dst, unsigned long n);
+void to_double24(void *src, double *dst, unsigned long n);
+void to_double_f32(void *src, double *dst, unsigned long n);
+void to_double_f64(void *src, double *dst, unsigned long n);
+int stream_normalize(job *jb);
+void process_existing_files(job *jb, char *folder, char *outfolder);
+int watch_folder_mode(job *jb, char *folder, char *outfolder);
 int is_file_ready(char *filepath);
 int move_file_to_output(char *srcpath, char *outfolder);
 
 int main(int argc, char *argv[]) {
 
-	int				i;
+	int				i, err;
+	batch			files;
+	job				*jb;
 	
+	kernels_init();
+	memset(&files, 0, sizeof(files));
+
 	/* Parse command line */
 	for (i = 1; i < argc; i++) {
 		if ((argv[i][0] == '-') && (argv[i][1] != 0x00)) {
@@ -142,7 +336,7 @@ int main(int argc, char *argv[]) {
 						return 2;
 					} else {
 						dowhat = 1;
-						ratio = atof(argv[++i]);
+						fixed_ratio = atof(argv[++i]);
 					}
 					break;
 				case 'a':
@@ -151,7 +345,60 @@ int main(int argc, char *argv[]) {
 						return 2;
 					} else {
 						dowhat = 2;
-						ratio = pow(10, atof(argv[++i]) / 20);
+						fixed_ratio = pow(10, atof(argv[++i]) / 20);
+					}
+					break;
+				case 'M':
+					use_mmap = 1;
+					break;
+				case 'f':
+					noclip = 1;
+					break;
+				case 't':
+					truepeak_mode = 1;
+					break;
+				case 'c':
+					use_cache = 1;
+					break;
+				case 'u':
+					use_table16 = 1;
+					break;
+				case 'D':
+					dither = 1;
+					break;
+				case 'r':
+					use_limiter = 1;
+					break;
+				case 'S':
+					stream_ms = atoi(argv[++i]);
+					if ((stream_ms < LIMIT_LOOKAHEAD_MS) || (stream_ms > 60000)) {
+						fprintf(stderr, "Stream latency must be between %d and 60000 ms.\n", LIMIT_LOOKAHEAD_MS);
+						return 2;
+					}
+					break;
+				case 'i':
+					if ((sscanf(argv[++i], "%lu:%hu:%lu", &raw_format.samplerate, &raw_format.nchannels, &raw_format.bitspersample) != 3) ||
+						(raw_format.samplerate == 0) || (raw_format.nchannels == 0) ||
+						((raw_format.bitspersample != 8) && (raw_format.bitspersample != 16) && (raw_format.bitspersample != 24) &&
+						 (raw_format.bitspersample != 32) && (raw_format.bitspersample != 64))) {
+						fprintf(stderr, "Raw input format must be <rate>:<channels>:<bits> (8, 16, 24, or 32/64 for float).\n");
+						return 2;
+					}
+					raw_format.format = (raw_format.bitspersample >= 32) ? 3 : 1;
+					raw_input = 1;
+					break;
+				case 'e':
+					estimate_percent = atof(argv[++i]);
+					if ((estimate_percent <= 0.0) || (estimate_percent > 100.0)) {
+						fprintf(stderr, "Estimate percentage must be between 0 and 100.\n");
+						return 2;
+					}
+					break;
+				case 'j':
+					nthreads = atoi(argv[++i]);
+					if ((nthreads < 1) || (nthreads > MAXTHREADS)) {
+						fprintf(stderr, "Number of threads must be between 1 and %d.\n", MAXTHREADS);
+						return 2;
 					}
 					break;
 				case 'b':
@@ -193,10 +440,54 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	if (truepeak_mode && smartpeak) {
+		fprintf(stderr, "You can't specify both -s and -t. Aborting.\n");
+		return 2;
+	}
+
+	if (use_limiter) {
+		if (dowhat != 3) {
+			fprintf(stderr, "The limiter (-r) only works with -L. Aborting.\n");
+			return 2;
+		}
+		if (smartpeak || dither) {
+			fprintf(stderr, "You can't specify -r with -s or -D. Aborting.\n");
+			return 2;
+		}
+	}
+
+	if (stream_ms) {
+		if (dowhat != 3) {
+			fprintf(stderr, "Streaming (-S) needs a -L target. Aborting.\n");
+			return 2;
+		}
+		if (smartpeak || dither || nooverwrite || watch_mode) {
+			fprintf(stderr, "You can't specify -S with -s, -D, -o or -w. Aborting.\n");
+			return 2;
+		}
+	} else if (raw_input) {
+		fprintf(stderr, "Raw input (-i) only works with -S. Aborting.\n");
+		return 2;
+	}
+
 	// this way the percentile peak is amplified to the correct level
 	if (smartpeak)
 		normpercent *= peakpercent / 100.0;
 
+	// Handle stream mode (standard input to standard output, no file)
+	if (stream_ms) {
+		if (!quiet)
+			fprintf(stderr, "\n%s\n\n", COPYRIGHT_NOTICE);
+
+		if ((jb = job_new(0)) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for the stream.\n");
+			return 4;
+		}
+		err = stream_normalize(jb);
+		job_free(jb);
+		return err;
+	}
+
 	// Handle watch mode
 	if (watch_mode) {
 		if (output_folder[0] == '\0') {
@@ -212,7 +503,14 @@ int main(int argc, char *argv[]) {
 			fprintf(stderr, "Press Ctrl+C to stop...\n\n");
 		}
 		
-		return watch_folder_mode(watch_folder, output_folder);
+		// one job for all the files, so that it can keep its tables
+		if ((jb = job_new(0)) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for the file workers.\n");
+			return 4;
+		}
+		err = watch_folder_mode(jb, watch_folder, output_folder);
+		job_free(jb);
+		return err;
 	}
 
 	if (i >= argc) {
@@ -223,259 +521,563 @@ int main(int argc, char *argv[]) {
 	if (!quiet)
 		fprintf(stderr, "\n%s\n\n", COPYRIGHT_NOTICE);
 
-	return process_filespec(argv[i]);
+	// The shell may already have expanded wildcards into several arguments
+	for (; i < argc; i++) {
+		if (!collect_files(&files, argv[i])) {
+			fprintf(stderr, "Cannot allocate memory for the file list.\n");
+			return 4;
+		}
+		// an argument that names no file ends the batch, as it would stop it
+		if (files.file[files.nfiles - 1].missing)
+			break;
+	}
 
-	return 0;
+	return run_batch(&files);
+}
+
+// Appends a file to a batch; missing marks an argument that didn't name any
+// file (see batch_file). Returns 0 if out of memory.
+int batch_add(batch *b, char *fname, int missing) {
+	batch_file	*f;
+
+	if (b->nfiles == b->size) {
+		f = (batch_file*)realloc(b->file, (b->size ? 2 * b->size : 64) * sizeof(batch_file));
+		if (f == NULL)
+			return 0;
+		b->file = f;
+		b->size = b->size ? 2 * b->size : 64;
+	}
+
+	f = &b->file[b->nfiles];
+	memset(f, 0, sizeof(batch_file));
+	if ((f->fname = (char*)malloc(strlen(fname) + 1)) == NULL)
+		return 0;
+	strcpy(f->fname, fname);
+	f->missing = missing;
+	b->nfiles++;
+
+	return 1;
 }
 
-int process_filespec(char *fspec) {
+#ifdef _WIN32
+int collect_files(batch *b, char *fspec) {
 	long	hFile;
 	char	myfullpath[_MAX_PATH];
 	char	drive[_MAX_DRIVE];
 	char	dir[_MAX_DIR];
 	struct	_finddata_t my_file;
-	int		err;
+	int		nfiles = b->nfiles;
 
 	_fullpath(myfullpath, fspec, _MAX_PATH);
 	_splitpath(myfullpath, drive, dir, NULL, NULL);
 
 	if ((hFile = _findfirst(fspec, &my_file)) == -1L)
-		fprintf(stderr, "Could not find file %s.\n", fspec);
-	else {
-		
-		do {
+		return batch_add(b, fspec, 1);
 
-			if (my_file.attrib & _A_SUBDIR)
-				continue;
+	do {
 
-			sprintf(myfullpath, "%s%s%s", drive, dir, my_file.name);
-			
-			err = process_file(myfullpath);
-			if (err && (err != 3)) {
-				
-				if ((err != 5) || !dontabort)
-					return err;
-			}
+		if (my_file.attrib & _A_SUBDIR)
+			continue;
+
+		sprintf(myfullpath, "%s%s%s", drive, dir, my_file.name);
+
+		if (!batch_add(b, myfullpath, 0)) {
+			_findclose(hFile);
+			return 0;
+		}
+
+	} while (_findnext(hFile, &my_file) == 0);
+
+	_findclose(hFile);
+
+	return (b->nfiles > nfiles) || batch_add(b, fspec, 2);
+}
+#else
+int collect_files(batch *b, char *fspec) {
+	glob_t	g;
+	size_t	n;
+	int		nfiles = b->nfiles;
+
+	if (glob(fspec, GLOB_MARK, NULL, &g) != 0)
+		return batch_add(b, fspec, 1);
+
+	for (n = 0; n < g.gl_pathc; n++) {
+
+		// GLOB_MARK appends a slash to directories
+		if (g.gl_pathv[n][strlen(g.gl_pathv[n]) - 1] == '/')
+			continue;
+
+		if (!batch_add(b, g.gl_pathv[n], 0)) {
+			globfree(&g);
+			return 0;
+		}
+	}
+
+	globfree(&g);
 
-		} while (_findnext(hFile, &my_file) == 0);
+	return (b->nfiles > nfiles) || batch_add(b, fspec, 2);
+}
+#endif
+
+// Processes the files of a batch in order and returns what the last one
+// returned, stopping at the first error unless -d lets it go on. With -j and
+// several files, up to nthreads files are processed at once, each by a worker
+// with a job of its own; a file's messages are held back until all the files
+// before it have been reported, so that they read as if the files had been
+// processed one by one. -p asks about the files in turn and -o writes them all
+// to the same output file, so these run one file at a time.
+int run_batch(batch *b) {
+	job		*jobs[MAXTHREADS];
+	thread	worker[MAXTHREADS];
+	int		nworkers, n, err = 1;
+
+	nworkers = (nthreads < b->nfiles) ? nthreads : b->nfiles;
+	if (prompt || nooverwrite || (nworkers < 1))
+		nworkers = 1;
+
+	for (n = 0; n < nworkers; n++) {
+		if ((jobs[n] = job_new(nworkers > 1)) == NULL) {
+			fprintf(stderr, "Cannot allocate memory for the file workers.\n");
+			while (n--)
+				job_free(jobs[n]);
+			return 4;
+		}
+		// the threads left over split the passes over each file (-j)
+		jobs[n]->nthreads = nthreads / nworkers;
+		jobs[n]->files = b;
+	}
+
+	mutex_init(&b->lock);
+
+	// a worker that can't be started leaves its files to the others
+	for (n = 1; n < nworkers; n++)
+		if (!thread_start(&worker[n], batch_worker, jobs[n]))
+			break;
+	batch_worker(jobs[0]);
+	while (--n > 0)
+		thread_join(&worker[n]);
+
+	mutex_free(&b->lock);
 
-		_findclose(hFile);
+	for (n = 0; n < nworkers; n++)
+		job_free(jobs[n]);
+
+	for (n = 0; n < b->nfiles; n++) {
+		err = b->file[n].result;
+		if (err && (err != 3) && ((err != 5) || !dontabort))
+			break;
 	}
 
+	for (n = 0; n < b->nfiles; n++)
+		free(b->file[n].fname);
+	free(b->file);
+
 	return err;
 }
 
-int process_file(char *fname) {
+// Takes the files of the batch one after the other until none are left or
+// one of them failed, and prints the messages of every file whose turn has
+// come
+void batch_worker(void *arg) {
+	job			*jb = (job*)arg;
+	batch		*b = jb->files;
+	batch_file	*f;
+	int			k;
+
+	for (;;) {
+		mutex_lock(&b->lock);
+		k = b->next;
+		if (b->stop || (k >= b->nfiles)) {
+			mutex_unlock(&b->lock);
+			break;
+		}
+		b->next++;
+		mutex_unlock(&b->lock);
+
+		f = &b->file[k];
+		if (f->missing) {
+			if (f->missing == 1)
+				job_printf(jb, "Could not find file %s.\n", f->fname);
+			f->result = 1;
+		} else
+			f->result = process_file(jb, f->fname);
+
+		mutex_lock(&b->lock);
+		f->log = jb->log;
+		jb->log = NULL;
+		jb->loglen = jb->logsize = 0;
+		f->done = 1;
+		if (f->result && (f->result != 3) && ((f->result != 5) || !dontabort))
+			b->stop = 1;
+
+		while ((b->nreported < b->nfiles) && b->file[b->nreported].done) {
+			if (b->file[b->nreported].log) {
+				fputs(b->file[b->nreported].log, stderr);
+				free(b->file[b->nreported].log);
+			}
+			b->nreported++;
+		}
+		fflush(stderr);
+		mutex_unlock(&b->lock);
+	}
+}
+
+// Creates a job; a buffered one keeps its messages in its log (see
+// job_printf()). Returns NULL if out of memory.
+job *job_new(int buffered) {
+	job		*jb;
+
+	// zero-filled, so the tables start out empty
+	jb = (job*)VirtualAlloc(NULL, sizeof(job), MEM_COMMIT, PAGE_READWRITE);
+	if (jb == NULL)
+		return NULL;
+
+	jb->nthreads = nthreads;
+	jb->buffered = buffered;
+	mutex_init(&jb->loglock);
+
+	return jb;
+}
+
+void job_free(job *jb) {
+	if (jb->table8)
+		VirtualFree(jb->table8, 0, MEM_RELEASE);
+	if (jb->table16)
+		VirtualFree(jb->table16, 0, MEM_RELEASE);
+	free(jb->log);
+	mutex_free(&jb->loglock);
+	VirtualFree(jb, 0, MEM_RELEASE);
+}
+
+// fprintf(stderr, ...) for the messages about a job's file. A buffered job
+// appends them to its log instead; if the log can't grow, they are printed
+// right away.
+void job_printf(job *jb, const char *fmt, ...) {
+	va_list	ap;
+	char	line[2048];
+	char	*log;
+	int		len;
+
+	va_start(ap, fmt);
+	if (!jb->buffered) {
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if (len >= (int)sizeof(line))
+		len = sizeof(line) - 1;
+
+	mutex_lock(&jb->loglock);
+	if (jb->loglen + len + 1 > jb->logsize) {
+		log = (char*)realloc(jb->log, 2 * (jb->loglen + len + 1));
+		if (log == NULL) {
+			fputs(line, stderr);
+			mutex_unlock(&jb->loglock);
+			return;
+		}
+		jb->log = log;
+		jb->logsize = 2 * (jb->loglen + len + 1);
+	}
+	memcpy(jb->log + jb->loglen, line, len + 1);
+	jb->loglen += len;
+	mutex_unlock(&jb->loglock);
+}
+
+int process_file(job *jb, char *fname) {
 
 	clock_t		sclk, eclk;
+	analysis	an;
 	double		atime;
-	unsigned long	ndata;
+	unsigned long long	ndata = 0;
+	cache_entry	ce;
+	unsigned int	need;
+	int			cacheok = 0;
+	double		gainlo = 0, gainhi = 0;	// dB bounds on the gain of an estimate (-e)
+	int			peakgain;			// the gain was held down by the peaks found
 
 	if (!quiet) {
 		
-		fprintf(stderr, "-------------------------------------------------------------------------------\n");
-		fprintf(stderr, "Processing file %s\n\n", fname);
+		job_printf(jb, "-------------------------------------------------------------------------------\n");
+		job_printf(jb, "Processing file %s\n\n", fname);
 	}
 
 	// Open PCM WAV file
-	if (!pcmwav_open(fname, GENERIC_READ | GENERIC_WRITE, &pwf)) {
+	if (!pcmwav_open(fname, GENERIC_READ | GENERIC_WRITE, &jb->pwf)) {
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
+			job_printf(jb, "%s\n", pcmwav_error);
 		return 1;
 	}
 
 	if (nooverwrite) {
-		char	hdrbuf[16384];
-		DWORD	nread;
-
-		outf = CreateFile(outfname, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
-			FILE_ATTRIBUTE_NORMAL, NULL);
-		if (outf == INVALID_HANDLE_VALUE) {
-			if (!quiet)
-				fprintf(stderr, "Couldn't open output file '%s'.\n", outfname);
-			return 1;
-		}
-		// Copy headers
-		SetFilePointer(pwf.winfile, 0, NULL, FILE_BEGIN);
-		ReadFile(pwf.winfile, hdrbuf, pwf.datapos, &nread, NULL);
-		if (nread != pwf.datapos) {
+		// Create output file with the same headers
+		if (!pcmwav_create(outfname, &jb->pwf, &jb->outwf)) {
 			if (!quiet)
-				fprintf(stderr, "Could not copy headers.\n");
-			return 1;
-		}
-		SetFilePointer(pwf.winfile, pwf.datapos, NULL, FILE_BEGIN);
-		WriteFile(outf, hdrbuf, pwf.datapos, &nread, NULL);
-		if (nread != pwf.datapos) {
-			if (!quiet)
-				fprintf(stderr, "Could not copy headers.\n");
+				job_printf(jb, "Couldn't open output file '%s': %s\n", outfname, pcmwav_error);
+			pcmwav_close(&jb->pwf);
 			return 1;
 		}
 	}
 
+	// Mapped views are much cheaper when they are large
+	jb->chunksize = iobufsize;
+	if (use_mmap && (jb->chunksize < MAPVIEWSIZE))
+		jb->chunksize = MAPVIEWSIZE;
+
+	// Chunks always hold whole sample frames (24-bit frames don't divide the buffer size)
+	jb->chunksize -= jb->chunksize % (jb->pwf.nchannels * (jb->pwf.bitspersample / 8));
+
 	// Allocate buffer
-	buf = VirtualAlloc(NULL, iobufsize, MEM_COMMIT, PAGE_READWRITE);
+	jb->buf = VirtualAlloc(NULL, jb->chunksize, MEM_COMMIT, PAGE_READWRITE);
 
-	if (buf == NULL) {
+	if (jb->buf == NULL) {
 		if (!quiet)
-			fprintf(stderr, "Cannot allocate buffer in memory.\n");
+			job_printf(jb, "Cannot allocate buffer in memory.\n");
+		pcmwav_close(&jb->pwf);
+		if (nooverwrite)
+			pcmwav_close(&jb->outwf);
 		return 1;
 	}
 
-	buf8 = (signed char*)buf;
-	buf16 = (signed short*)buf;
+	jb->estimating = (estimate_percent > 0);
+
+	// -l and -a give the ratio; the other modes measure it
+	jb->ratio = fixed_ratio;
+
+measure:
+	an.estimated = 0;
+	jb->limiting = 0;
+	peakgain = 0;
+	cacheok = 0;
+
+	// With -c, the results of an earlier run on this very file can stand in
+	// for pass 1; the sections it lacks are measured and added
+	if (use_cache && !watch_mode && ((dowhat == 0) || (dowhat == 3))) {
+		if (cache_identify(fname, &jb->pwf, &ce)) {
+			cacheok = 1;
+			cache_load(fname, &ce);
+		} else if (!quiet)
+			job_printf(jb, "%s\n", pcmwav_error);
+	}
 
 	if (dowhat == 0) {
-		if (pwf.bitspersample == 8) {
-			signed char	mins, maxs;
+		need = (smartpeak ? CACHE_STATS : CACHE_PEAKS) | (truepeak_mode ? CACHE_TRUEPEAK : 0);
 
+		if (cacheok && ((ce.sections & need) == need)) {
 			if (!quiet)
-				fprintf(stderr, "Pass 1: Finding peak levels...\n");
-
-			if (!getpeaks8(&mins, &maxs))
-				return 1;
-
+				job_printf(jb, "Pass 1: Using cached peak levels...\n");
+			cached_peaks(jb, &an, &ce);
+		} else {
 			if (!quiet)
-				fprintf(stderr, "\rMinimum level found: %d, maximum level found: %d\n", (short)mins, (short)maxs);
-
-			if (mins == -128)
-				mins = -127;
-
-			if ((-mins) > maxs)
-				maxs = -mins;
-
-			if (maxs == 0) {
-				if (!quiet)
-					fprintf(stderr, "All zero samples found.\n");
-				ratio = 1;
-			} else {
-				ratio = (127.0 * normpercent) / ((double)maxs * 100.0);
+				job_printf(jb, "Pass 1: Finding peak levels...\n");
+
+			if (!analyze(jb, &an, 1, NULL, cacheok ? &ce : NULL)) {
+				if (cacheok)
+					cache_free(&ce);
+				VirtualFree(jb->buf, 0, MEM_RELEASE);
+				pcmwav_close(&jb->pwf);
+				if (nooverwrite)
+					pcmwav_close(&jb->outwf);
+				return 1;
 			}
 
-		} else if (pwf.bitspersample == 16) {
-			signed short	mins, maxs;
-
-			if (!quiet)
-				fprintf(stderr, "Pass 1: Finding peak levels...\n");
+			if (cacheok && !an.estimated && !cache_save(fname, &ce) && !quiet)
+				job_printf(jb, "\r%s\n", pcmwav_error);
+		}
+		if (cacheok)
+			cache_free(&ce);
 
-			if (!getpeaks16(&mins, &maxs))
-				return 1;
+		if (!quiet) {
+			if (jb->pwf.format == 3)
+				job_printf(jb, "\rMinimum level found: %.6f, maximum level found: %.6f\n", an.minpeak, an.maxpeak);
+			else
+				job_printf(jb, "\rMinimum level found: %d, maximum level found: %d\n", (int)an.minpeak, (int)an.maxpeak);
+			if (truepeak_mode && (an.truepeak > 0))
+				job_printf(jb, "True peak found: %.2f dBTP\n", 20.0 * log10(an.truepeak));
+			if (an.estimated)
+				job_printf(jb, "(estimated from %g%% of the file; the peaks may be higher)\n", estimate_percent);
+		}
 
+		jb->ratio = peak_ratio(jb, &an);
+		peakgain = 1;
+		if (an.estimated)
+			estimate_bounds(jb, jb->ratio, &gainlo, &gainhi);
+		if (jb->ratio == 0) {
 			if (!quiet)
-				fprintf(stderr, "\rMinimum level found: %d, maximum level found: %d\n", mins, maxs);
-
-			if (mins == -32768)
-				mins = -32767;
-
-			if ((-mins) > maxs)
-				maxs = -mins;
-
-			if (maxs == 0) {
-				if (!quiet)
-					fprintf(stderr, "All zero samples found.\n");
-				ratio = 1;
-			} else {
-				ratio = (32767.0 * normpercent) / ((double)maxs * 100.0);
-			}
+				job_printf(jb, "All zero samples found.\n");
+			jb->ratio = 1;
 		}
 	} else if (dowhat == 3) {
-		// LUFS normalization mode
+		// LUFS normalization mode; with peak limiting the peaks are found
+		// in the same pass
 		double measured_lufs;
+		lufs_meter meter;
+		// -t keeps true peaks below the -m level (0 dBTP by default), and so
+		// does the limiter (-r)
+		int limit = (normpercent < 100.0) || truepeak_mode || use_limiter;
 		
-		if (!quiet)
-			fprintf(stderr, "Pass 1: Calculating LUFS loudness...\n");
+		need = CACHE_LUFS;
+		if (limit)
+			need |= (smartpeak ? CACHE_STATS : CACHE_PEAKS) | (truepeak_mode ? CACHE_TRUEPEAK : 0);
+		
+		if (!lufs_init(&meter, jb->pwf.samplerate, jb->pwf.nchannels, jb->pwf.channelmask)) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate memory for LUFS calculation.\n");
+			if (cacheok)
+				cache_free(&ce);
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
+			if (nooverwrite)
+				pcmwav_close(&jb->outwf);
+			return 4;
+		}
 		
-		if (pwf.bitspersample == 8) {
-			measured_lufs = calculate_lufs8();
-		} else if (pwf.bitspersample == 16) {
-			measured_lufs = calculate_lufs16();
+		if (cacheok && ((ce.sections & need) == need)) {
+			if (!quiet)
+				job_printf(jb, limit ? "Pass 1: Using cached LUFS loudness and peak levels...\n" :
+					"Pass 1: Using cached LUFS loudness...\n");
+			cache_restore_meter(&ce, &meter);
+			if (limit)
+				cached_peaks(jb, &an, &ce);
 		} else {
 			if (!quiet)
-				fprintf(stderr, "Unsupported bit depth for LUFS calculation.\n");
-			VirtualFree(buf, 0, MEM_RELEASE);
-			pcmwav_close(&pwf);
-			return 1;
+				job_printf(jb, limit ? "Pass 1: Calculating LUFS loudness and peak levels...\n" :
+					"Pass 1: Calculating LUFS loudness...\n");
+			
+			if (!analyze(jb, &an, limit, &meter, cacheok ? &ce : NULL)) {
+				lufs_free(&meter);
+				if (cacheok)
+					cache_free(&ce);
+				VirtualFree(jb->buf, 0, MEM_RELEASE);
+				pcmwav_close(&jb->pwf);
+				if (nooverwrite)
+					pcmwav_close(&jb->outwf);
+				return 1;
+			}
+			
+			if (cacheok && !an.estimated && (!cache_store_meter(&ce, &meter) || !cache_save(fname, &ce)) && !quiet)
+				job_printf(jb, "\r%s\n", pcmwav_error);
 		}
+		if (cacheok)
+			cache_free(&ce);
+		
+		measured_lufs = lufs_integrated(&meter, gate_percentile);
 		
 		if (!quiet) {
-			fprintf(stderr, "\rMeasured loudness: %.1f LUFS\n", measured_lufs);
-			fprintf(stderr, "Target loudness: %.1f LUFS\n", target_lufs);
+			if (!an.estimated) {
+				job_printf(jb, "\rMeasured loudness: %.1f LUFS\n", measured_lufs);
+				job_printf(jb, "Max momentary: %.1f LUFS, max short-term: %.1f LUFS, loudness range: %.1f LU\n",
+					meter.max_momentary, meter.max_shortterm, lufs_range(&meter));
+			} else if (an.lufs_below >= 0)
+				job_printf(jb, "\rEstimated loudness: %.1f LUFS (95%% interval %.1f to %.1f LUFS)\n", measured_lufs,
+					measured_lufs - an.lufs_below, measured_lufs + an.lufs_above);
+			else if (an.lufs_above >= 0)
+				job_printf(jb, "\rEstimated loudness: %.1f LUFS (95%% interval up to %.1f LUFS)\n", measured_lufs,
+					measured_lufs + an.lufs_above);
+			else
+				job_printf(jb, "\rEstimated loudness: %.1f LUFS (error unknown)\n", measured_lufs);
+			job_printf(jb, "Target loudness: %.1f LUFS\n", target_lufs);
+			if (truepeak_mode && (an.truepeak > 0))
+				job_printf(jb, "True peak found: %.2f dBTP\n", 20.0 * log10(an.truepeak));
 		}
+		lufs_free(&meter);
 		
 		// Calculate gain adjustment
 		double lufs_delta = target_lufs - measured_lufs;
-		ratio = pow(10.0, lufs_delta / 20.0);
+		jb->ratio = pow(10.0, lufs_delta / 20.0);
+		if (an.estimated) {
+			// a louder file needs less gain
+			gainlo = (an.lufs_above >= 0) ? lufs_delta - an.lufs_above : -HUGE_VAL;
+			gainhi = (an.lufs_below >= 0) ? lufs_delta + an.lufs_below : HUGE_VAL;
+		}
 		
-		// Optional: Apply peak limiting to prevent clipping
-		if (normpercent < 100.0) {
-			double max_ratio;
-			if (pwf.bitspersample == 8) {
-				signed char mins, maxs;
-				if (!quiet)
-					fprintf(stderr, "Pass 1b: Finding peaks for limiting...\n");
-				if (getpeaks8(&mins, &maxs)) {
-					if (mins == -128) mins = -127;
-					if ((-mins) > maxs) maxs = -mins;
-					if (maxs > 0) {
-						max_ratio = (127.0 * normpercent) / ((double)maxs * 100.0);
-						if (ratio > max_ratio) {
-							if (!quiet)
-								fprintf(stderr, "Limiting gain to prevent clipping (%.1f dB reduction)\n", 
-									20.0 * log10(ratio / max_ratio));
-							ratio = max_ratio;
-						}
-					}
-				}
-			} else if (pwf.bitspersample == 16) {
-				signed short mins, maxs;
-				if (!quiet)
-					fprintf(stderr, "Pass 1b: Finding peaks for limiting...\n");
-				if (getpeaks16(&mins, &maxs)) {
-					if (mins == -32768) mins = -32767;
-					if ((-mins) > maxs) maxs = -mins;
-					if (maxs > 0) {
-						max_ratio = (32767.0 * normpercent) / ((double)maxs * 100.0);
-						if (ratio > max_ratio) {
-							if (!quiet)
-								fprintf(stderr, "Limiting gain to prevent clipping (%.1f dB reduction)\n", 
-									20.0 * log10(ratio / max_ratio));
-							ratio = max_ratio;
-						}
-					}
+		// Optional: Apply peak limiting to prevent clipping; the limiter
+		// turns down the peaks alone and leaves the gain as it is
+		if (limit) {
+			double max_ratio = peak_ratio(jb, &an);
+			peakgain = 1;
+			if ((max_ratio > 0) && (jb->ratio > max_ratio)) {
+				if (use_limiter) {
+					if (!quiet)
+						job_printf(jb, "Limiting peaks with a %d ms lookahead limiter (up to %.1f dB reduction)\n",
+							LIMIT_LOOKAHEAD_MS, 20.0 * log10(jb->ratio / max_ratio));
+					jb->limiting = 1;
+				} else {
+					if (!quiet)
+						job_printf(jb, "Limiting gain to prevent clipping (%.1f dB reduction)\n", 
+							20.0 * log10(jb->ratio / max_ratio));
+					jb->ratio = max_ratio;
 				}
 			}
+			// the limiter catches the peaks an estimate missed as well
+			if (an.estimated && use_limiter)
+				jb->limiting = 1;
+			else if (an.estimated) {
+				double peaklo, peakhi;
+				
+				estimate_bounds(jb, max_ratio, &peaklo, &peakhi);
+				if (peaklo < gainlo)
+					gainlo = peaklo;
+				if (peakhi < gainhi)
+					gainhi = peakhi;
+			}
 		}
 	}
 
-	if (ratio == 1) {
+	// An estimate settles -x only if the whole of its gain interval lies on
+	// one side of the threshold
+	if (an.estimated && usemingain && (gainlo < mingain) && (gainhi > -mingain) &&
+		((gainlo <= -mingain) || (gainhi >= mingain))) {
+		if (!quiet)
+			job_printf(jb, "Estimate is too close to the -x threshold; measuring the whole file...\n");
+		jb->estimating = 0;
+		goto measure;
+	}
+
+	// Estimated peaks are only lower bounds, so a gain they allow may clip
+	// the samples that weren't read; unless the limiter is there to catch
+	// them, the whole file is measured before anything is written
+	if (an.estimated && peakgain && !jb->limiting && (jb->ratio != 1) &&
+		!(usemingain && (fabs(20.0 * log10(jb->ratio)) < mingain))) {
 		if (!quiet)
-			fprintf(stderr, "No amplification required; skipping.\n");
+			job_printf(jb, "Peaks were estimated; measuring the whole file before amplifying...\n");
+		jb->estimating = 0;
+		goto measure;
+	}
+
+	if (jb->ratio == 1) {
+		if (!quiet)
+			job_printf(jb, "No amplification required; skipping.\n");
 		if (nooverwrite) {
 			/* copy existing data */
-			ndata = passthrough();
-			VirtualFree(buf, 0, MEM_RELEASE);
-			pcmwav_close(&pwf);
-			CloseHandle(outf);
+			ndata = passthrough(jb);
+			pcmwav_close(&jb->outwf);
 		}
+		VirtualFree(jb->buf, 0, MEM_RELEASE);
+		pcmwav_close(&jb->pwf);
 		return 3;
-	} else if (ratio < 1) {
+	} else if (jb->ratio < 1) {
 		if (!quiet)
-			fprintf(stderr, "Performing attenuation of %.03f dB\n", 20.0 * log10(ratio));
-	} else if (ratio > 1) {
+			job_printf(jb, "Performing attenuation of %.03f dB\n", 20.0 * log10(jb->ratio));
+	} else if (jb->ratio > 1) {
 		if (!quiet)
-			fprintf(stderr, "Performing amplification of %.03f dB\n", 20.0 * log10(ratio));
+			job_printf(jb, "Performing amplification of %.03f dB\n", 20.0 * log10(jb->ratio));
 	}
 
 	if (usemingain) {
-		if (fabs(20.0 * log10(ratio)) < mingain) {
+		if (fabs(20.0 * log10(jb->ratio)) < mingain) {
 			if (!quiet)
-				fprintf(stderr, "Level is smaller than %.03f dB, aborting.\n", mingain);
+				job_printf(jb, "Level is smaller than %.03f dB, aborting.\n", mingain);
 			if (nooverwrite) {
 				/* copy existing data */
-				ndata = passthrough();
-				VirtualFree(buf, 0, MEM_RELEASE);
-				pcmwav_close(&pwf);
-				CloseHandle(outf);
+				ndata = passthrough(jb);
+				pcmwav_close(&jb->outwf);
 			}
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
 			return 3;
 		}
 	}
@@ -483,973 +1085,1867 @@ int process_file(char *fname) {
 	if (prompt) {
 		char	inanswer;
 		fflush(stdin);
-		fprintf(stderr, "\nStart normalization? (Y/N) ");
+		job_printf(jb, "\nStart normalization? (Y/N) ");
 		inanswer = getchar();
 		if ((inanswer != 'y') && (inanswer != 'Y')) {
-			VirtualFree(buf, 0, MEM_RELEASE);
-			pcmwav_close(&pwf);
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
 			if (nooverwrite)
-				CloseHandle(outf);
+				pcmwav_close(&jb->outwf);
 			return 5;
 		}
 	}
 
 	if (!quiet)
-		fprintf(stderr, "\nAmplifying...\n");
+		job_printf(jb, "\nAmplifying...\n");
 
 	sclk = clock();
-	if (pwf.bitspersample == 8) {
-		table8 = (signed char*)VirtualAlloc(NULL, 256, MEM_COMMIT, PAGE_READWRITE);
-
-		if (table8 == NULL) {
+	if (jb->limiting) {
+		// the limiter scales the samples of every format itself
+		if (!limiter_init(&jb->lim, jb->pwf.samplerate, jb->pwf.nchannels, full_scale(jb) * normpercent / 100.0, truepeak_mode) ||
+			((jb->limitbuf = (unsigned char*)VirtualAlloc(NULL, jb->lim.look * jb->pwf.nchannels * (jb->pwf.bitspersample / 8), MEM_COMMIT, PAGE_READWRITE)) == NULL)) {
 			if (!quiet)
-				fprintf(stderr, "Cannot allocate translation table in memory.\n");
+				job_printf(jb, "Cannot allocate memory for the limiter.\n");
+			limiter_free(&jb->lim);
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
+			if (nooverwrite)
+				pcmwav_close(&jb->outwf);
 			return 4;
 		}
+		ndata = run_amplify(jb, limitk);
 
-		make_table8();
-		ndata = amplify8();
-		VirtualFree(table8, 0, MEM_RELEASE);
+	} else if (jb->pwf.bitspersample == 8) {
+		// dithered samples each round differently, so -D can't use a table
+		if (!dither && !gain_table8(jb)) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate translation table in memory.\n");
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
+			if (nooverwrite)
+				pcmwav_close(&jb->outwf);
+			return 4;
+		}
 
-	} else if (pwf.bitspersample == 16) {
-		table16 = (signed short*)VirtualAlloc(NULL, 131072, MEM_COMMIT, PAGE_READWRITE);
+		ndata = amplify8(jb);
 
-		if (table16 == NULL) {
+	} else if (jb->pwf.bitspersample == 16) {
+		// gain16() computes what the table would hold; -u keeps the table
+		if (use_table16 && !dither && !gain_table16(jb)) {
 			if (!quiet)
-				fprintf(stderr, "Cannot allocate translation table in memory.\n");
+				job_printf(jb, "Cannot allocate translation table in memory.\n");
+			VirtualFree(jb->buf, 0, MEM_RELEASE);
+			pcmwav_close(&jb->pwf);
+			if (nooverwrite)
+				pcmwav_close(&jb->outwf);
 			return 4;
 		}
-		make_table16();
-		ndata = amplify16();
-		VirtualFree(table16, 0, MEM_RELEASE);
+		ndata = amplify16(jb);
+
+	} else if (jb->pwf.bitspersample == 24) {
+		// A 16M-entry table would not fit the cache; gain24() scales directly
+		ndata = amplify24(jb);
+
+	} else if (jb->pwf.format == 3) {
+		ndata = amplifyf(jb);
 	}
 	eclk = clock();
 
 	if (!quiet)
-		fprintf(stderr, "\n\nDone.\n");
+		job_printf(jb, "\n\nDone.\n");
+
+	if (jb->limiting) {
+		if (!quiet)
+			job_printf(jb, "Limiter gain reduction: up to %.1f dB\n", -20.0 * log10(jb->lim.lowest));
+		limiter_free(&jb->lim);
+		VirtualFree(jb->limitbuf, 0, MEM_RELEASE);
+	}
 
 	atime = (double)(eclk - sclk) / (double)CLOCKS_PER_SEC;
 
 	if (atime < 1.0) {
 		if (!quiet)
-			fprintf(stderr, "Time taken: %.01f sec.\n", atime);
+			job_printf(jb, "Time taken: %.01f sec.\n", atime);
 	} else {
 		if (!quiet)
-			fprintf(stderr, "Time taken: %.01f sec. (throughput: %.03f MBps)\n",
+			job_printf(jb, "Time taken: %.01f sec. (throughput: %.03f MBps)\n",
 				atime, ((double)ndata / 1048576.0) / atime);
 	}
 
-	VirtualFree(buf, 0, MEM_RELEASE);
-	pcmwav_close(&pwf);
+	VirtualFree(jb->buf, 0, MEM_RELEASE);
+	pcmwav_close(&jb->pwf);
 
 	if (nooverwrite)
-		CloseHandle(outf);
+		pcmwav_close(&jb->outwf);
+	else if (use_cache)
+		// the cached results were those of the old samples
+		cache_remove(fname);
 
 	return 0;
 }
 
+#ifdef _MSC_VER
 #pragma optimize("", off)
-void make_table8(void) {
+#endif
+void make_table8(job *jb) {
 	unsigned char	i = 0;
 
 	do {
-		if (((signed char)i * ratio) > 127.0)
-			table8[i ^ 0x80] = (signed char)0xFF;
-		else if (((signed char)i * ratio) < -127.0)
-			table8[i ^ 0x80] = 0x00;
+		if (((signed char)i * jb->ratio) > 127.0)
+			jb->table8[i ^ 0x80] = (signed char)0xFF;
+		else if (((signed char)i * jb->ratio) < -127.0)
+			jb->table8[i ^ 0x80] = 0x00;
 		else
-			table8[i ^ 0x80] = (signed char)(((signed char)i) * ratio) ^ 0x80;
+			jb->table8[i ^ 0x80] = (signed char)(((signed char)i) * jb->ratio) ^ 0x80;
 	} while (++i);
 }
+#ifdef _MSC_VER
 #pragma optimize("", on)
+#endif
 
-#pragma optimize("", off)
-void make_table16(void) {
-	unsigned short	i = 0;
+// Every sample value scaled by gain_s16(), which gives the same entries as
+// the scalar loop this used to be, a vector at a time
+void make_table16(job *jb) {
+	unsigned long	i;
 
-	do {
-		if (((signed short)i * ratio) > 32767)
-			table16[i] = 32767;
-		else if (((signed short)i * ratio) < -32767)
-			table16[i] = -32767;
-		else
-			table16[i] = (signed short)(((signed short)i) * ratio);
-	} while (++i);
+	for (i = 0; i < 65536; i++)
+		jb->table16[i] = (signed short)i;
+	gain_s16(jb->table16, 65536, jb->ratio);
 }
-#pragma optimize("", on)
-
-int getpeaks8(signed char *minpeak, signed char *maxpeak) {
-	unsigned long				i, ndone = 0, readn;
-	register signed char		minp = 0, maxp = 0, cur;
-	int							npercent, lastn = -1;
-	unsigned long				*stats;
-	unsigned long				numstat;
 
-	if (smartpeak) {
-		// allocate memory for the sample statistics
-		stats = (unsigned long*)VirtualAlloc(NULL, sizeof(unsigned long) * 256, MEM_COMMIT, PAGE_READWRITE);
-		
-		if (stats == NULL) {
-			if (!quiet)
-				fprintf(stderr, "Cannot allocate buffer in memory.\n");
+// The tables of a job are allocated once and only rebuilt when the ratio
+// changes, so that a -l or -a batch builds them for the first file of each
+// worker only; amplify threads only read them. Return 0 if out of memory.
+int gain_table8(job *jb) {
+	if (jb->table8 == NULL) {
+		jb->table8 = (signed char*)VirtualAlloc(NULL, 256, MEM_COMMIT, PAGE_READWRITE);
+		if (jb->table8 == NULL)
 			return 0;
-		}
-
-		for (i = 0; i < 256; i++)
-			stats[i] = 0;
+	}
 
-		numstat = 0;
+	if (!jb->table8_ok || (jb->table8_ratio != jb->ratio)) {
+		make_table8(jb);
+		jb->table8_ratio = jb->ratio;
+		jb->table8_ok = 1;
 	}
 
-	
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
+	return 1;
+}
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
-		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
-		return 0;
+int gain_table16(job *jb) {
+	if (jb->table16 == NULL) {
+		jb->table16 = (signed short*)VirtualAlloc(NULL, 131072, MEM_COMMIT, PAGE_READWRITE);
+		if (jb->table16 == NULL)
+			return 0;
 	}
 
-	while (readn) {
-		for (i = 0; i < readn; i++) {
-			cur = buf8[i] ^ 0x80;
+	if (!jb->table16_ok || (jb->table16_ratio != jb->ratio)) {
+		make_table16(jb);
+		jb->table16_ratio = jb->ratio;
+		jb->table16_ok = 1;
+	}
 
-			if (smartpeak) {
-				stats[128 + cur]++;
-				numstat++;
-			} else {
-				if (cur < minp)
-					minp = cur;
-				if (cur > maxp)
-					maxp = cur;	
-			}
+	return 1;
+}
+
+// Peak scanners for analyze(): widen the peak range, or fill the smartpeak
+// histogram, with one chunk of samples. Consecutive samples are counted in
+// different sub-histograms so that runs of equal values don't keep
+// incrementing the same counter; analyze() adds them up at the end.
+void peaks8(analysis *an, void *chunk, unsigned long len) {
+	unsigned char				*p = (unsigned char*)chunk;
+	unsigned long				i;
+	// 8-bit samples are unsigned with a 128 offset, so the range is kept raw
+	unsigned char				minp = (unsigned char)((int)an->minpeak + 128), maxp = (unsigned char)((int)an->maxpeak + 128);
+	unsigned long long			*h0, *h1, *h2, *h3;
+
+	if (an->stats) {
+		// the raw sample is the bin number
+		h0 = an->stats;
+		h1 = h0 + 256;
+		h2 = h1 + 256;
+		h3 = h2 + 256;
+		for (i = 0; i + 4 <= len; i += 4) {
+			h0[p[i]]++;
+			h1[p[i + 1]]++;
+			h2[p[i + 2]]++;
+			h3[p[i + 3]]++;
 		}
+		for (; i < len; i++)
+			h0[p[i]]++;
+		an->numstat += len;
+		return;
+	}
 
-		ndone += readn;
+	minmax_u8(p, len, &minp, &maxp);
 
-		if (!quiet) {
-			npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
-			if (npercent > lastn) {
-				fprintf(stderr, "\r%d%%", npercent);
-				fflush(stderr);
-				lastn = npercent;
-			}
+	an->minpeak = minp - 128;
+	an->maxpeak = maxp - 128;
+}
+
+void peaks16(analysis *an, void *chunk, unsigned long len) {
+	signed short				*p = (signed short*)chunk;
+	unsigned long				i;
+	signed short				minp = (signed short)an->minpeak, maxp = (signed short)an->maxpeak;
+	unsigned long long			*h0, *h1, *h2, *h3;
+
+	if (an->stats) {
+		h0 = an->stats + 32768;
+		h1 = h0 + 65536;
+		h2 = h1 + 65536;
+		h3 = h2 + 65536;
+		len >>= 1;
+		for (i = 0; i + 4 <= len; i += 4) {
+			h0[p[i]]++;
+			h1[p[i + 1]]++;
+			h2[p[i + 2]]++;
+			h3[p[i + 3]]++;
 		}
+		for (; i < len; i++)
+			h0[p[i]]++;
+		an->numstat += len;
+		return;
+	}
 
-		readn = iobufsize;
-		if (readn > (pwf.ndatabytes - ndone))
-			readn = pwf.ndatabytes - ndone;
+	minmax_s16(p, len>>1, &minp, &maxp);
 
-		if (readn) {
-			if (!pcmwav_read(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
-		}
-		else
-			break;
+	an->minpeak = minp;
+	an->maxpeak = maxp;
+}
+
+// 24-bit smartpeak statistics use the top 16 bits of each sample
+void peaks24(analysis *an, void *chunk, unsigned long len) {
+	unsigned char				*p = (unsigned char*)chunk;
+	unsigned long				i, j, n;
+	int							minp = (int)an->minpeak, maxp = (int)an->maxpeak;
+	int							block[KERNELBLOCK];
+	unsigned long long			*h0 = NULL, *h1 = NULL, *h2 = NULL, *h3 = NULL;
+
+	if (an->stats) {
+		h0 = an->stats + 32768;
+		h1 = h0 + 65536;
+		h2 = h1 + 65536;
+		h3 = h2 + 65536;
 	}
 
-	if (smartpeak) {
-		// let's find how many samples is <percent> of the max
-		numstat *= 1.0 - (peakpercent / 100.0);
-		// let's use this to accumulate values
-		ndone = 0;
-		// let's count the min sample value that has the given percentile
-		for (i = 0; (i < 256) && (ndone <= numstat); i++)
-			ndone += stats[i];
-		minp = i - 129;
-		// let's count the max sample value that has the given percentile
-		ndone = 0;
-		for (i = 255; (i >= 0) && (ndone <= numstat); i--)
-			ndone += stats[i];
-		maxp = i - 127;
-		VirtualFree(stats, 0, MEM_RELEASE);
+	for (i = 0; i < len / 3; i += n) {
+		n = len / 3 - i;
+		if (n > KERNELBLOCK)
+			n = KERNELBLOCK;
+		unpack24(p + 3 * i, block, n);
+
+		if (an->stats) {
+			for (j = 0; j + 4 <= n; j += 4) {
+				h0[block[j] >> 8]++;
+				h1[block[j + 1] >> 8]++;
+				h2[block[j + 2] >> 8]++;
+				h3[block[j + 3] >> 8]++;
+			}
+			for (; j < n; j++)
+				h0[block[j] >> 8]++;
+			an->numstat += n;
+			continue;
+		}
+
+		minmax_s32(block, n, &minp, &maxp);
+	}
+
+	an->minpeak = minp;
+	an->maxpeak = maxp;
+}
+
+// Float smartpeak statistics use 65536 bins between -1.0 and 1.0, with
+// samples beyond full scale in the end bins. Returns the bin of a sample, or
+// -1 for a NaN (which isn't counted).
+int float_bin(double cur) {
+	if (cur != cur)
+		return -1;
+	cur = floor(cur * 32768.0);
+	return 32768 + ((cur < -32768.0) ? -32768 : ((cur > 32767.0) ? 32767 : (int)cur));
+}
+
+void peaks_f32(analysis *an, void *chunk, unsigned long len) {
+	float			*p = (float*)chunk;
+	float			minp = (float)an->minpeak, maxp = (float)an->maxpeak;
+	unsigned long	i;
+	int				bin;
+
+	if (an->stats) {
+		for (i = 0; i < len / 4; i++) {
+			if ((bin = float_bin(p[i])) >= 0) {
+				an->stats[(i % NSTATHIST) * 65536 + bin]++;
+				an->numstat++;
+			}
+		}
+		return;
 	}
 
-	pcmwav_rewind(&pwf);
+	minmax_f32(p, len / 4, &minp, &maxp);
+	an->minpeak = minp;
+	an->maxpeak = maxp;
+}
 
-	*minpeak = minp;
-	*maxpeak = maxp;
+void peaks_f64(analysis *an, void *chunk, unsigned long len) {
+	double			*p = (double*)chunk;
+	unsigned long	i;
+	int				bin;
 
-	return 1;
+	if (an->stats) {
+		for (i = 0; i < len / 8; i++) {
+			if ((bin = float_bin(p[i])) >= 0) {
+				an->stats[(i % NSTATHIST) * 65536 + bin]++;
+				an->numstat++;
+			}
+		}
+		return;
+	}
+
+	minmax_f64(p, len / 8, &an->minpeak, &an->maxpeak);
 }
 
-int getpeaks16(signed short *minpeak, signed short *maxpeak) {
-	unsigned long				i, ndone = 0, readn;
-	register signed short		minp = 0, maxp = 0, cur;
+// Reads the data chunk once, finding the peak levels (if peaks is set) and
+// feeding the loudness meter (if meter isn't NULL) from each chunk while it
+// is still in the cache. With smartpeak, the peaks are the lowest and highest
+// sample of the given percentile; with -t, the true peak is measured from the
+// same chunks. If ce isn't NULL, the peak results are also put in its
+// sections for the analysis cache. Returns 1 if successful or 0 on error.
+int analyze(job *jb, analysis *an, int peaks, lufs_meter *meter, cache_entry *ce) {
+	unsigned long				i, n, readn, nbins = 0;
+	unsigned long long			ndone = 0, total;
+	unsigned long				bytes = jb->pwf.bitspersample / 8;
 	int							npercent, lastn = -1;
-	unsigned long				*stats;
-	unsigned long				numstat;
+	char						*chunk;
+	void						(*scan)(analysis *an, void *chunk, unsigned long len) = NULL;
+	void						(*convert)(void *src, double *dst, unsigned long n) = NULL;
+	double						samples[LUFSBLOCK];
+	// the meter takes whole frames
+	unsigned long				lufsblock = LUFSBLOCK - LUFSBLOCK % jb->pwf.nchannels;
+	truepeak_meter				tpmeter, *tp = NULL;
+
+	an->minpeak = an->maxpeak = 0;
+	an->stats = NULL;
+	an->numstat = 0;
+	an->truepeak = 0;
+	an->estimated = 0;
+	an->lufs_below = an->lufs_above = -1;
+
+	if (peaks) {
+		if (jb->pwf.format == 3)
+			scan = (jb->pwf.bitspersample == 32) ? peaks_f32 : peaks_f64;
+		else if (jb->pwf.bitspersample == 8)
+			scan = peaks8;
+		else if (jb->pwf.bitspersample == 16)
+			scan = peaks16;
+		else
+			scan = peaks24;
+	}
 
-	if (smartpeak) {
+	if (meter || (peaks && truepeak_mode)) {
+		if (jb->pwf.format == 3)
+			convert = (jb->pwf.bitspersample == 32) ? to_double_f32 : to_double_f64;
+		else if (jb->pwf.bitspersample == 8)
+			convert = to_double8;
+		else if (jb->pwf.bitspersample == 16)
+			convert = to_double16;
+		else
+			convert = to_double24;
+
+		if (lufsblock == 0) {
+			if (!quiet)
+				job_printf(jb, "Too many channels for LUFS measurement.\n");
+			return 0;
+		}
+	}
+
+	if (peaks && truepeak_mode) {
+		if (!truepeak_init(&tpmeter, jb->pwf.nchannels)) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate buffer in memory.\n");
+			return 0;
+		}
+		tp = &tpmeter;
+	}
+
+	if (peaks && smartpeak) {
 		// allocate memory for the sample statistics
-		stats = (unsigned long*)VirtualAlloc(NULL, sizeof(unsigned long) * 65536, MEM_COMMIT, PAGE_READWRITE);
+		nbins = (jb->pwf.bitspersample == 8) ? 256 : 65536;
+		an->stats = (unsigned long long*)VirtualAlloc(NULL, sizeof(unsigned long long) * NSTATHIST * nbins, MEM_COMMIT, PAGE_READWRITE);
 		
-		if (stats == NULL) {
+		if (an->stats == NULL) {
 			if (!quiet)
-				fprintf(stderr, "Cannot allocate buffer in memory.\n");
+				job_printf(jb, "Cannot allocate buffer in memory.\n");
+			if (tp)
+				truepeak_free(tp);
 			return 0;
 		}
 
-		for (i = 0; i < 65536; i++)
-			stats[i] = 0;
+		for (i = 0; i < NSTATHIST * nbins; i++)
+			an->stats[i] = 0;
+	}
 
-		numstat = 0;
+	// with -e only regions spread over the file are read
+	if (jb->estimating) {
+		switch (analyze_regions(jb, an, meter, tp, scan, convert)) {
+			case 0:
+				if (an->stats)
+					VirtualFree(an->stats, 0, MEM_RELEASE);
+				if (tp)
+					truepeak_free(tp);
+				return 0;
+			case 1:
+				ndone = jb->pwf.ndatabytes;
+				// the cache only keeps measurements of the whole file
+				ce = NULL;
+				break;
+		}
 	}
 
-	
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
+	// long files are analyzed in segments on several threads when asked to
+	if ((jb->nthreads > 1) && (ndone < jb->pwf.ndatabytes)) {
+		switch (analyze_segments(jb, an, meter, tp, scan, convert, nbins)) {
+			case 0:
+				if (an->stats)
+					VirtualFree(an->stats, 0, MEM_RELEASE);
+				if (tp)
+					truepeak_free(tp);
+				return 0;
+			case 1:
+				ndone = jb->pwf.ndatabytes;
+				break;
+		}
+	}
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
-		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
+	while (ndone < jb->pwf.ndatabytes) {
+		readn = jb->chunksize;
+		if (readn > (jb->pwf.ndatabytes - ndone))
+			readn = (unsigned long)(jb->pwf.ndatabytes - ndone);
+
+		if ((chunk = (char*)get_chunk(jb, ndone, readn, 0, jb->buf)) == NULL) {
+			if (an->stats)
+				VirtualFree(an->stats, 0, MEM_RELEASE);
+			if (tp)
+				truepeak_free(tp);
+			return 0;
+		}
+
+		if (scan)
+			scan(an, chunk, readn);
+
+		if (convert) {
+			for (i = 0; i < readn / bytes; i += n) {
+				n = readn / bytes - i;
+				if (n > lufsblock)
+					n = lufsblock;
+				convert(chunk + i * bytes, samples, n);
+				if (meter)
+					lufs_feed(meter, samples, n);
+				if (tp)
+					truepeak_feed(tp, samples, n);
+			}
+		}
+
+		put_chunk(jb, chunk, ndone, readn, 0);
+		ndone += readn;
+
+		if (!quiet && !jb->buffered) {
+			npercent = (int)(100.0 * ((double)ndone / (double)jb->pwf.ndatabytes));
+			if (npercent > lastn) {
+				job_printf(jb, meter ? "\rPass 1 (LUFS): %d%%" : "\r%d%%", npercent);
+				fflush(stderr);
+				lastn = npercent;
+			}
+		}
+	}
+
+	if (tp) {
+		an->truepeak = truepeak_max(tp);
+		truepeak_free(tp);
+		if (ce) {
+			ce->truepeak = an->truepeak;
+			ce->sections |= CACHE_TRUEPEAK;
+		}
+	}
+
+	if (an->stats && (an->numstat == 0)) {
+		// nothing to count: the peaks stay at zero
+		VirtualFree(an->stats, 0, MEM_RELEASE);
+		an->stats = NULL;
+	}
+
+	if (an->stats) {
+		// merge the sub-histograms into cumulative counts in the first one
+		total = 0;
+		for (i = 0; i < nbins; i++) {
+			for (n = 0; n < NSTATHIST; n++)
+				total += an->stats[n * nbins + i];
+			an->stats[i] = total;
+		}
+
+		if (ce) {
+			if (ce->stats == NULL)
+				ce->stats = (unsigned long long*)malloc(65536 * sizeof(unsigned long long));
+			if (ce->stats) {
+				memcpy(ce->stats, an->stats, nbins * sizeof(unsigned long long));
+				ce->nbins = nbins;
+				ce->numstat = an->numstat;
+				ce->sections |= CACHE_STATS;
+			}
+		}
+
+		smartpeak_levels(jb, an, an->stats, nbins);
+		VirtualFree(an->stats, 0, MEM_RELEASE);
+		an->stats = NULL;
+	} else if (peaks && !smartpeak && ce) {
+		ce->minpeak = an->minpeak;
+		ce->maxpeak = an->maxpeak;
+		ce->sections |= CACHE_PEAKS;
+	}
+
+	return 1;
+}
+
+// Sets the peaks to the lowest and highest sample of the smartpeak
+// percentile, from the cumulative histogram of an->numstat samples
+void smartpeak_levels(job *jb, analysis *an, unsigned long long *cum, unsigned long nbins) {
+	unsigned long long	numstat;
+	long				lobin, hibin;
+
+	// let's find how many samples is <percent> of the max
+	numstat = (unsigned long long)(an->numstat * (1.0 - (peakpercent / 100.0)));
+	// the min sample value that has the given percentile: the first bin
+	// with more than numstat samples at or below it
+	lobin = (long)first_bin_above(cum, nbins, numstat);
+	// the max sample value: the last bin with more than numstat samples
+	// at or above it
+	hibin = (long)first_bin_above(cum, nbins, an->numstat - numstat - 1);
+
+	if (jb->pwf.format == 3) {
+		an->minpeak = (lobin - 32768) / 32768.0;
+		an->maxpeak = (hibin - 32767) / 32768.0;
+	} else if (jb->pwf.bitspersample == 8) {
+		an->minpeak = lobin - 128;
+		an->maxpeak = hibin - 128;
+	} else if (jb->pwf.bitspersample == 16) {
+		an->minpeak = lobin - 32768;
+		an->maxpeak = hibin - 32768;
+	} else {
+		// rounded outwards to the edges of the 256-value bins
+		an->minpeak = (lobin - 32768) * 256;
+		an->maxpeak = (hibin - 32768) * 256 + 255;
+	}
+}
+
+// Fills in the peaks of an from the analysis cache, as analyze() would have
+// found them
+void cached_peaks(job *jb, analysis *an, cache_entry *ce) {
+	an->minpeak = an->maxpeak = 0;
+	an->stats = NULL;
+	an->numstat = 0;
+	an->truepeak = ce->truepeak;
+	an->estimated = 0;
+	an->lufs_below = an->lufs_above = -1;
+
+	if (smartpeak) {
+		an->numstat = ce->numstat;
+		if (an->numstat)
+			smartpeak_levels(jb, an, ce->stats, ce->nbins);
+	} else {
+		an->minpeak = ce->minpeak;
+		an->maxpeak = ce->maxpeak;
+	}
+}
+
+// Scans the peaks and/or measures the loudness (if meter isn't NULL) with the
+// data chunk split into up to nthreads segments on threads of their own. For
+// the loudness each segment starts on a 100 ms sub-block boundary and first
+// runs WARMUPSUB sub-blocks before it through the K-weighting filters, so
+// that their state has settled to that of a serial pass; the sub-block
+// energies of the segments are then merged in order. Peaks, true peaks (if
+// tp isn't NULL) and smartpeak histograms are merged as they are; the
+// true-peak interpolator picks up the frames before each segment as history. Returns 1 if successful, 0 on error or
+// -1 if the file is too short to be worth splitting.
+int analyze_segments(job *jb, analysis *an, lufs_meter *meter, truepeak_meter *tp, void (*scan)(analysis *an, void *chunk, unsigned long len),
+	void (*convert)(void *src, double *dst, unsigned long n), unsigned long nbins) {
+	segpass				*sp;
+	segment				*sg;
+	unsigned long long	unit, nunits;
+	unsigned long		i;
+	int					k, nsegs = jb->nthreads, ok = 1;
+
+	if (meter) {
+		unit = (unsigned long long)meter->hop_samples * jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+		nunits = jb->pwf.ndatabytes / unit;
+		if (nsegs > nunits / SEGMINSUB)
+			nsegs = (int)(nunits / SEGMINSUB);
+	} else {
+		unit = jb->chunksize;
+		nunits = jb->pwf.ndatabytes / unit;
+		if (nsegs > nunits / SEGMINCHUNKS)
+			nsegs = (int)(nunits / SEGMINCHUNKS);
+	}
+	if (nsegs < 2)
+		return -1;
+
+	if ((sp = segpass_init(jb, nsegs, unit, 0)) == NULL)
 		return 0;
+	sp->warmup = meter ? WARMUPSUB * unit : 0;
+	if (tp && (sp->warmup < TRUEPEAK_HIST * jb->pwf.nchannels * (jb->pwf.bitspersample / 8)))
+		sp->warmup = TRUEPEAK_HIST * jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+	sp->scan = scan;
+	sp->convert = convert;
+	sp->lufs = (meter != NULL);
+	sp->truepeak = (tp != NULL);
+
+	for (k = 0; k < nsegs; k++) {
+		sg = &sp->seg[k];
+		if (meter && !lufs_init_segment(&sg->meter, meter, (unsigned long)((sg->end - sg->start) / unit)))
+			ok = 0;
+		else if (tp && !truepeak_init(&sg->tp, jb->pwf.nchannels))
+			ok = 0;
+		else if (nbins && ((sg->an.stats = (unsigned long long*)VirtualAlloc(NULL, sizeof(unsigned long long) * NSTATHIST * nbins, MEM_COMMIT, PAGE_READWRITE)) == NULL))
+			ok = 0;
+		if (!ok) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate buffer in memory.\n");
+			segpass_free(sp);
+			return 0;
+		}
+
+		for (i = 0; nbins && (i < NSTATHIST * nbins); i++)
+			sg->an.stats[i] = 0;
 	}
 
-	while (readn) {
-		for (i = 0; i < (readn>>1); i++) {
-			cur = buf16[i];
-			if (smartpeak) {
-				stats[32768 + cur]++;
-				numstat++;
+	ok = segpass_run(sp, segment_worker, meter ? "\rPass 1 (LUFS): %d%%" : "\r%d%%");
+
+	for (k = 0; ok && (k < nsegs); k++) {
+		sg = &sp->seg[k];
+		if (meter)
+			lufs_merge(meter, &sg->meter);
+		if (tp)
+			truepeak_merge(tp, &sg->tp);
+		if (scan) {
+			if (sg->an.minpeak < an->minpeak)
+				an->minpeak = sg->an.minpeak;
+			if (sg->an.maxpeak > an->maxpeak)
+				an->maxpeak = sg->an.maxpeak;
+		}
+		if (nbins) {
+			for (i = 0; i < NSTATHIST * nbins; i++)
+				an->stats[i] += sg->an.stats[i];
+			an->numstat += sg->an.numstat;
+		}
+	}
+
+	segpass_free(sp);
+
+	return ok;
+}
+
+// Worker of analyze_segments(): warms up the filters, then scans and meters
+// one segment
+void segment_worker(void *arg) {
+	segment				*sg = (segment*)arg;
+	segpass				*sp = sg->pass;
+	job					*jb = sp->jb;
+	unsigned long long	pos = (sg->start > sp->warmup) ? sg->start - sp->warmup : 0;
+	unsigned long		i, n, readn;
+	unsigned long		bytes = jb->pwf.bitspersample / 8;
+	unsigned long		lufsblock = LUFSBLOCK - LUFSBLOCK % jb->pwf.nchannels;
+	char				*chunk;
+	double				samples[LUFSBLOCK];
+
+	while (pos < sg->end) {
+		readn = jb->chunksize;
+		if ((pos < sg->start) && (readn > sg->start - pos))
+			readn = (unsigned long)(sg->start - pos);
+		if (readn > sg->end - pos)
+			readn = (unsigned long)(sg->end - pos);
+
+		if ((chunk = (char*)get_chunk(jb, pos, readn, 0, sg->mem)) == NULL) {
+			sg->error = 1;
+			break;
+		}
+
+		if (sp->scan && (pos >= sg->start))
+			sp->scan(&sg->an, chunk, readn);
+
+		for (i = 0; sp->convert && (i < readn / bytes); i += n) {
+			n = readn / bytes - i;
+			if (n > lufsblock)
+				n = lufsblock;
+			sp->convert(chunk + i * bytes, samples, n);
+			if (pos < sg->start) {
+				if (sp->lufs)
+					lufs_warmup(&sg->meter, samples, n);
+				if (sp->truepeak)
+					truepeak_warmup(&sg->tp, samples, n);
 			} else {
-				if (cur < minp)
-					minp = cur;
-				if (cur > maxp)
-					maxp = cur;
+				if (sp->lufs)
+					lufs_feed(&sg->meter, samples, n);
+				if (sp->truepeak)
+					truepeak_feed(&sg->tp, samples, n);
 			}
 		}
 
-		ndone += readn;
+		put_chunk(jb, chunk, pos, readn, 0);
 
-		if (!quiet) {
-			npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
+		if (pos >= sg->start)
+			segment_tick(sp, readn, 0);
+		pos += readn;
+	}
+
+	segment_tick(sp, 0, 1);
+}
+
+// Estimates the peaks and/or the loudness (if meter isn't NULL) from regions
+// of REGIONSUB 100 ms sub-blocks covering about estimate_percent of the file:
+// one region at a random offset in each stretch of the file, so that every
+// part of it gets its share. Like a segment, each region first runs the
+// WARMUPSUB sub-blocks before it through the filters; the meter is restarted
+// so that no block spans two regions. The loudness error is estimated from
+// how much the energy of the gated blocks varies between regions (a ratio
+// estimate over a cluster sample) and left in an->lufs_below/lufs_above. Returns 1 if
+// successful, 0 on error or -1 if the regions would cover so much of the
+// file that reading all of it is as quick.
+int analyze_regions(job *jb, analysis *an, lufs_meter *meter, truepeak_meter *tp, void (*scan)(analysis *an, void *chunk, unsigned long len),
+	void (*convert)(void *src, double *dst, unsigned long n)) {
+	unsigned long long	framebytes = (unsigned long long)jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+	unsigned long long	unit, nunits, stride, start, warm, pos, end, seed = 1;
+	unsigned long long	nblocks = 0;
+	unsigned long		i, n, r, nregions, readn;
+	unsigned long		bytes = jb->pwf.bitspersample / 8;
+	unsigned long		lufsblock = LUFSBLOCK - LUFSBLOCK % jb->pwf.nchannels;
+	int					npercent, lastn = -1;
+	char				*chunk;
+	double				samples[LUFSBLOCK];
+	double				energy = 0, sume = 0, sumn = 0, sumee = 0, sumen = 0, sumnn = 0;
+	double				mean, resid, se, f;
+
+	// regions are made of 100 ms sub-blocks (those of the meter if there is one)
+	if (meter)
+		unit = meter->hop_samples * framebytes;
+	else
+		unit = (jb->pwf.samplerate >= 10 ? jb->pwf.samplerate / 10 : 1) * framebytes;
+	nunits = jb->pwf.ndatabytes / unit;
+	nregions = (unsigned long)(nunits * (estimate_percent / 100.0) / REGIONSUB);
+	if ((nregions < 2) || ((unsigned long long)nregions * (REGIONSUB + WARMUPSUB) * 2 > nunits))
+		return -1;
+	stride = nunits / nregions;
+
+	for (r = 0; r < nregions; r++) {
+		// the same regions every run (64-bit LCG)
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		start = r * stride + (seed >> 33) % (stride - REGIONSUB + 1);
+		warm = (start > WARMUPSUB) ? WARMUPSUB : start;
+		if (!meter && !tp)
+			warm = 0;
+		pos = (start - warm) * unit;
+		end = (start + REGIONSUB) * unit;
+		start *= unit;
+
+		if (meter) {
+			lufs_restart(meter);
+			energy = meter->gated_energy;
+			nblocks = meter->block_count - meter->hist_below;
+		}
+
+		while (pos < end) {
+			readn = jb->chunksize;
+			if ((pos < start) && (readn > start - pos))
+				readn = (unsigned long)(start - pos);
+			if (readn > end - pos)
+				readn = (unsigned long)(end - pos);
+
+			if ((chunk = (char*)get_chunk(jb, pos, readn, 0, jb->buf)) == NULL)
+				return 0;
+
+			if (scan && (pos >= start))
+				scan(an, chunk, readn);
+
+			for (i = 0; convert && (i < readn / bytes); i += n) {
+				n = readn / bytes - i;
+				if (n > lufsblock)
+					n = lufsblock;
+				convert(chunk + i * bytes, samples, n);
+				if (pos < start) {
+					if (meter)
+						lufs_warmup(meter, samples, n);
+					if (tp)
+						truepeak_warmup(tp, samples, n);
+				} else {
+					if (meter)
+						lufs_feed(meter, samples, n);
+					if (tp)
+						truepeak_feed(tp, samples, n);
+				}
+			}
+
+			put_chunk(jb, chunk, pos, readn, 0);
+			pos += readn;
+		}
+
+		if (meter) {
+			energy = meter->gated_energy - energy;
+			nblocks = meter->block_count - meter->hist_below - nblocks;
+			sume += energy;
+			sumn += (double)nblocks;
+			sumee += energy * energy;
+			sumen += energy * nblocks;
+			sumnn += (double)nblocks * nblocks;
+		}
+
+		if (!quiet && !jb->buffered) {
+			npercent = (int)(100.0 * (r + 1) / nregions);
 			if (npercent > lastn) {
-				fprintf(stderr, "\r%d%%", npercent);
+				job_printf(jb, meter ? "\rPass 1 (LUFS estimate): %d%%" : "\rEstimate: %d%%", npercent);
 				fflush(stderr);
 				lastn = npercent;
 			}
 		}
+	}
 
-		readn = iobufsize;
-		if (readn > (pwf.ndatabytes - ndone))
-			readn = pwf.ndatabytes - ndone;
+	an->estimated = 1;
+	an->lufs_below = an->lufs_above = -1;
+	if (meter && (sumn > 0) && (sume > 0)) {
+		// mean energy per gated block, and the variance of that mean from the
+		// spread of the regions around it (less the share of the file read)
+		mean = sume / sumn;
+		resid = sumee - 2.0 * mean * sumen + mean * mean * sumnn;
+		if (resid < 0)
+			resid = 0;
+		f = (double)nregions * REGIONSUB / nunits;
+		se = sqrt((1.0 - f) * resid / ((double)nregions * (nregions - 1))) / (sumn / nregions);
+		// the interval is wider on the quiet side, and has no end there if
+		// the energy could be 0
+		an->lufs_above = 10.0 * log10((mean + 1.96 * se) / mean);
+		if (mean > 1.96 * se)
+			an->lufs_below = 10.0 * log10(mean / (mean - 1.96 * se));
+	}
 
-		if (readn) {
-			if (!pcmwav_read(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
+	return 1;
+}
+
+// Allocates a multi-threaded pass with the data chunk split into nsegs
+// segments on multiples of unit bytes (the last one takes the rest), each
+// with a buffer of its own unless its chunks are mapped views. Set store for
+// a pass that writes the chunks back. Returns NULL on error.
+segpass *segpass_init(job *jb, int nsegs, unsigned long long unit, int store) {
+	segpass				*sp;
+	segment				*sg;
+	unsigned long long	nunits = jb->pwf.ndatabytes / unit;
+	int					k;
+
+	// zero-filled, so everything not set here starts out empty
+	sp = (segpass*)VirtualAlloc(NULL, sizeof(segpass), MEM_COMMIT, PAGE_READWRITE);
+	if (sp == NULL) {
+		if (!quiet)
+			job_printf(jb, "Cannot allocate buffer in memory.\n");
+		return NULL;
+	}
+	if (!semaphore_init(&sp->tick, 0)) {
+		VirtualFree(sp, 0, MEM_RELEASE);
+		if (!quiet)
+			job_printf(jb, "Cannot start worker threads.\n");
+		return NULL;
+	}
+	mutex_init(&sp->lock);
+	sp->jb = jb;
+	sp->nsegs = nsegs;
+	sp->nrunning = nsegs;
+
+	for (k = 0; k < nsegs; k++) {
+		sg = &sp->seg[k];
+		sg->pass = sp;
+		sg->start = nunits * k / nsegs * unit;
+		sg->end = (k == nsegs - 1) ? jb->pwf.ndatabytes : nunits * (k + 1) / nsegs * unit;
+
+		if ((!use_mmap || (store && nooverwrite))
+			&& ((sg->mem = (char*)VirtualAlloc(NULL, jb->chunksize, MEM_COMMIT, PAGE_READWRITE)) == NULL)) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate buffer in memory.\n");
+			segpass_free(sp);
+			return NULL;
+		}
+	}
+
+	return sp;
+}
+
+// Runs worker on every segment, each on a thread of its own (or on this one
+// if its thread can't be started), and shows the progress with the progress
+// format until all are done. Returns 1 if successful or 0 on error.
+int segpass_run(segpass *sp, void (*worker)(void *arg), char *progress) {
+	job					*jb = sp->jb;
+	unsigned long long	ndone;
+	int					k, nrunning, ok = 1, npercent, lastn = -1;
+
+	for (k = 0; k < sp->nsegs; k++)
+		sp->seg[k].started = thread_start(&sp->seg[k].worker, worker, &sp->seg[k]);
+	for (k = 0; k < sp->nsegs; k++) {
+		if (!sp->seg[k].started)
+			worker(&sp->seg[k]);
+	}
+
+	do {
+		semaphore_wait(&sp->tick);
+		mutex_lock(&sp->lock);
+		ndone = sp->ndone;
+		nrunning = sp->nrunning;
+		mutex_unlock(&sp->lock);
+
+		if (!quiet && !jb->buffered) {
+			npercent = (int)(100.0 * ((double)ndone / (double)jb->pwf.ndatabytes));
+			if (npercent > lastn) {
+				job_printf(jb, progress, npercent);
+				fflush(stderr);
+				lastn = npercent;
 			}
 		}
-		else
+	} while (nrunning > 0);
+
+	for (k = 0; k < sp->nsegs; k++) {
+		if (sp->seg[k].started)
+			thread_join(&sp->seg[k].worker);
+		if (sp->seg[k].error)
+			ok = 0;
+	}
+
+	return ok;
+}
+
+void segpass_free(segpass *sp) {
+	segment		*sg;
+	int			k;
+
+	for (k = 0; k < sp->nsegs; k++) {
+		sg = &sp->seg[k];
+		lufs_free(&sg->meter);
+		truepeak_free(&sg->tp);
+		if (sg->mem)
+			VirtualFree(sg->mem, 0, MEM_RELEASE);
+		if (sg->an.stats)
+			VirtualFree(sg->an.stats, 0, MEM_RELEASE);
+		free(sg->ds.err);
+	}
+
+	mutex_free(&sp->lock);
+	semaphore_free(&sp->tick);
+	VirtualFree(sp, 0, MEM_RELEASE);
+}
+
+// Called by the workers: counts n more bytes done, or one more segment
+// finished, and wakes up segpass_run()
+void segment_tick(segpass *sp, unsigned long n, int finished) {
+	mutex_lock(&sp->lock);
+	sp->ndone += n;
+	if (finished)
+		sp->nrunning--;
+	mutex_unlock(&sp->lock);
+	semaphore_post(&sp->tick);
+}
+
+// Runs kernel over the data chunk split into up to nthreads segments on
+// threads of their own, each reading, amplifying and storing its chunks with
+// positional I/O. Returns 1 if successful, 0 on error or -1 if the file is too
+// short to be worth splitting.
+int amplify_segments(job *jb, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds)) {
+	segpass		*sp;
+	int			k, ok, nsegs = jb->nthreads;
+	// with -D, segments start where the noise shaping restarts anyway, so
+	// that the result doesn't depend on where they are
+	unsigned long long	unit = dither ? (unsigned long long)DITHERBLOCK * jb->pwf.nchannels * (jb->pwf.bitspersample / 8) : jb->chunksize;
+
+	if (nsegs > jb->pwf.ndatabytes / jb->chunksize / SEGMINCHUNKS)
+		nsegs = (int)(jb->pwf.ndatabytes / jb->chunksize / SEGMINCHUNKS);
+	if (nsegs > jb->pwf.ndatabytes / unit)
+		nsegs = (int)(jb->pwf.ndatabytes / unit);
+	if (nsegs < 2)
+		return -1;
+
+	if ((sp = segpass_init(jb, nsegs, unit, 1)) == NULL)
+		return 0;
+	sp->kernel = kernel;
+
+	for (k = 0; k < nsegs; k++) {
+		sp->seg[k].ds.next = sp->seg[k].start;
+		if ((sp->seg[k].ds.err = (double*)calloc(jb->pwf.nchannels, sizeof(double))) == NULL) {
+			if (!quiet)
+				job_printf(jb, "Cannot allocate buffer in memory.\n");
+			segpass_free(sp);
+			return 0;
+		}
+	}
+
+	ok = segpass_run(sp, amplify_worker, "\r%d%%");
+	segpass_free(sp);
+
+	return ok;
+}
+
+// Worker of amplify_segments(): amplifies one segment
+void amplify_worker(void *arg) {
+	segment				*sg = (segment*)arg;
+	segpass				*sp = sg->pass;
+	job					*jb = sp->jb;
+	unsigned long long	pos = sg->start;
+	unsigned long		readn;
+	void				*chunk;
+
+	while (pos < sg->end) {
+		readn = jb->chunksize;
+		if (readn > sg->end - pos)
+			readn = (unsigned long)(sg->end - pos);
+
+		if ((chunk = get_chunk(jb, pos, readn, 1, sg->mem)) == NULL) {
+			sg->error = 1;
+			break;
+		}
+
+		if (sp->kernel)
+			sp->kernel(jb, chunk, readn, pos, &sg->ds);
+
+		if (!put_chunk(jb, chunk, pos, readn, 1)) {
+			sg->error = 1;
 			break;
+		}
+
+		segment_tick(sp, readn, 0);
+		pos += readn;
 	}
 
-	if (smartpeak) {
-		// let's find how many samples is <percent> of the max
-		numstat *= 1.0 - (peakpercent / 100.0);
-		// let's use this to accumulate values
-		ndone = 0;
-		// let's count the min sample value that has the given percentile
-		for (i = 0; (i < 65536) && (ndone <= numstat); i++)
-			ndone += stats[i];
-		minp = i - 32769;
-		// let's count the max sample value that has the given percentile
-		ndone = 0;
-		for (i = 65535; (i >= 0) && (ndone <= numstat); i--)
-			ndone += stats[i];
-		maxp = i - 32767;
-		VirtualFree(stats, 0, MEM_RELEASE);
+	segment_tick(sp, 0, 1);
+}
+
+// Binary search of a cumulative histogram: returns the first bin whose count
+// exceeds limit, or nbins if there is none
+unsigned long first_bin_above(unsigned long long *cum, unsigned long nbins, unsigned long long limit) {
+	unsigned long	lo = 0, hi = nbins, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cum[mid] > limit)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// Returns the highest positive sample value of the file's format
+double full_scale(job *jb) {
+	if (jb->pwf.format == 3)
+		return 1.0;
+	else if (jb->pwf.bitspersample == 8)
+		return 127.0;
+	else if (jb->pwf.bitspersample == 16)
+		return 32767.0;
+	else
+		return 8388607.0;
+}
+
+// Returns the gain that brings the peaks found by analyze() (the true peak
+// with -t) to normpercent of full scale, or 0 if all samples are zero
+double peak_ratio(job *jb, analysis *an) {
+	double	fullscale = full_scale(jb), tpeak, mins = an->minpeak, maxs = an->maxpeak;
+
+	// the most negative integer sample has no positive counterpart
+	if ((jb->pwf.format != 3) && (mins < -fullscale))
+		mins = -fullscale;
+
+	if ((-mins) > maxs)
+		maxs = -mins;
+
+	if (truepeak_mode) {
+		// measured on the meter's scale, where integer full scale is one
+		// step above fullscale
+		tpeak = an->truepeak * ((jb->pwf.format == 3) ? 1.0 : fullscale + 1.0);
+		if (tpeak > maxs)
+			maxs = tpeak;
+	}
+
+	if (maxs == 0)
+		return 0;
+
+	return (fullscale * normpercent) / (maxs * 100.0);
+}
+
+// Sets lo and hi to the bounds in dB on the gain that peak_ratio() would
+// give for the whole file, from its result r for the regions read by an
+// estimate: peaks missed can only be higher, but integer samples can't go
+// beyond full scale (true peaks and float samples can). Smartpeak percentiles
+// can move either way.
+void estimate_bounds(job *jb, double r, double *lo, double *hi) {
+	*hi = (smartpeak || (r == 0)) ? HUGE_VAL : 20.0 * log10(r);
+	*lo = ((jb->pwf.format == 3) || truepeak_mode) ? -HUGE_VAL : 20.0 * log10(normpercent / 100.0);
+}
+
+unsigned long long amplify8(job *jb) {
+	return run_amplify(jb, dither ? dither8 : gain8);
+}
+
+unsigned long long amplify16(job *jb) {
+	if (dither)
+		return run_amplify(jb, dither16);
+	return run_amplify(jb, use_table16 ? gain16_table : gain16);
+}
+
+unsigned long long amplify24(job *jb) {
+	return run_amplify(jb, dither ? dither24 : gain24);
+}
+
+unsigned long long amplifyf(job *jb) {
+	return run_amplify(jb, gainf);
+}
+
+unsigned long long passthrough(job *jb) {
+	return run_amplify(jb, NULL);
+}
+
+// Gain kernels: amplify the len bytes of samples of a chunk in place. pos is
+// the data offset of the chunk and ds the noise shaping state of the run of
+// chunks it continues; only the -D kernels use them.
+void gain8(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned char	*p = (unsigned char*)chunk;
+	unsigned long	i;
+
+	for (i = 0; i < len; i++) {
+		p[i] = jb->table8[p[i]];
+	}
+}
+
+// Scales like make_table16(), without a 128 KB table to miss in
+void gain16(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	gain_s16((short*)chunk, len >> 1, jb->ratio);
+}
+
+void gain16_table(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned short	*p = (unsigned short*)chunk;
+	unsigned long	i;
+
+	for (i = 0; i < (len>>1); i++) {
+		p[i] = jb->table16[p[i]];
+	}
+}
+
+// Scales like make_table16(): truncation towards zero, clamped to +/-8388607
+void gain24(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned char	*p = (unsigned char*)chunk;
+	int				block[KERNELBLOCK];
+	unsigned long	i, j, n;
+	double			v;
+
+	for (i = 0; i < len / 3; i += n) {
+		n = len / 3 - i;
+		if (n > KERNELBLOCK)
+			n = KERNELBLOCK;
+		unpack24(p + 3 * i, block, n);
+
+		for (j = 0; j < n; j++) {
+			v = block[j] * jb->ratio;
+			if (v > 8388607.0)
+				block[j] = 8388607;
+			else if (v < -8388607.0)
+				block[j] = -8388607;
+			else
+				block[j] = (int)v;
+		}
+
+		pack24(block, p + 3 * i, n);
+	}
+}
+
+// Float samples are scaled in place and clipped to full scale unless -f
+void gainf(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	if (jb->pwf.bitspersample == 32)
+		scale_f32((float*)chunk, len / 4, (float)jb->ratio, noclip ? 0.0f : 1.0f);
+	else
+		scale_f64((double*)chunk, len / 8, jb->ratio, noclip ? 0.0 : 1.0);
+}
+
+// -D kernels: the same gains as above, but the results are rounded with
+// TPDF dither and first-order noise shaping instead of truncated
+void dither8(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned char	*p = (unsigned char*)chunk;
+	int				block[KERNELBLOCK];
+	unsigned long	i, j, n;
+
+	for (i = 0; i < len; i += n) {
+		n = len - i;
+		if (n > KERNELBLOCK)
+			n = KERNELBLOCK;
+		for (j = 0; j < n; j++)
+			block[j] = p[i + j] - 128;
+		// as make_table8() clamps
+		requantize(jb, block, n, pos + i, -128, 127, ds);
+		for (j = 0; j < n; j++)
+			p[i + j] = (unsigned char)(block[j] + 128);
+	}
+}
+
+void dither16(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	short			*p = (short*)chunk;
+	int				block[KERNELBLOCK];
+	unsigned long	i, j, n;
+
+	for (i = 0; i < len / 2; i += n) {
+		n = len / 2 - i;
+		if (n > KERNELBLOCK)
+			n = KERNELBLOCK;
+		for (j = 0; j < n; j++)
+			block[j] = p[i + j];
+		requantize(jb, block, n, pos / 2 + i, -32767, 32767, ds);
+		for (j = 0; j < n; j++)
+			p[i + j] = (short)block[j];
+	}
+}
+
+void dither24(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned char	*p = (unsigned char*)chunk;
+	int				block[KERNELBLOCK];
+	unsigned long	i, n;
+
+	for (i = 0; i < len / 3; i += n) {
+		n = len / 3 - i;
+		if (n > KERNELBLOCK)
+			n = KERNELBLOCK;
+		unpack24(p + 3 * i, block, n);
+		requantize(jb, block, n, pos / 3 + i, -8388607, 8388607, ds);
+		pack24(block, p + 3 * i, n);
+	}
+}
+
+// Multiplies n samples by ratio and rounds them back to integers in lo..hi,
+// adding TPDF dither (tpdf_f64() noise keyed to the sample index, index being
+// that of s[0]) and feeding each channel's rounding error back into its next
+// sample, which moves the noise up in frequency. The feedback restarts every
+// DITHERBLOCK frames, and wherever s doesn't continue the run of ds, so that
+// the result doesn't depend on how the data is split into chunks.
+void requantize(job *jb, int *s, unsigned long n, unsigned long long index, int lo, int hi, dither_state *ds) {
+	// adding 1.5 * 2^52 and taking it away again rounds a double to an integer
+	const double	rounder = 6755399441055744.0, big = 2147483648.0;
+	double			noise[KERNELBLOCK], u[KERNELBLOCK];
+	double			y, q;
+	unsigned long	nch = jb->pwf.nchannels, c, i, j, run;
+	unsigned long long	restart = (unsigned long long)DITHERBLOCK * nch;
+	int				bytes = jb->pwf.bitspersample / 8;
+
+	if (index * bytes != ds->next)
+		memset(ds->err, 0, nch * sizeof(double));
+	ds->next = (index + n) * bytes;
+
+	// everything but the feedback, which is all that has to go in order
+	tpdf_f64(s, jb->ratio, index, u, noise, n);
+
+	// the feedback, in stretches up to the restarts; the channels' chains are
+	// independent, so they're stepped through together
+	c = (unsigned long)(index % nch);
+	for (i = 0; i < n; i += run) {
+		if ((index + i) % restart == 0)
+			memset(ds->err, 0, nch * sizeof(double));
+		run = (unsigned long)(restart - (index + i) % restart);
+		if (run > n - i)
+			run = n - i;
+
+		for (j = i; j < i + run; j++) {
+			// u is clamped well inside the range the rounding works for (the
+			// sample clips anyway)
+			y = (u[j] > big) ? big : (u[j] < -big) ? -big : u[j];
+			y -= ds->err[c];
+			q = (y + rounder) - rounder;
+			ds->err[c] = q - y + noise[j];
+			s[j] = (q > hi) ? hi : (q < lo) ? lo : (int)q;
+			if (++c == nch)
+				c = 0;
+		}
+	}
+}
+
+// -r kernel: the gain with the lookahead limiter, for samples of any format.
+// The limiter runs lim.look frames ahead of the chunk, which it reads from
+// the data after it (still untouched, as the chunks are amplified in order),
+// so the kernel has to see every chunk, in order, and nothing else.
+void limitk(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds) {
+	unsigned char	*p = (unsigned char*)chunk, *ahead = NULL;
+	unsigned long	framebytes = jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+	unsigned long	nframes = len / framebytes, nahead = 0, i, n;
+	unsigned long long	first = pos / framebytes, total = jb->pwf.ndatabytes / framebytes;
+	double			x[KERNELBLOCK], gain[KERNELBLOCK];
+
+	if (first + nframes < total) {
+		nahead = jb->lim.look;
+		if (nahead > total - first - nframes)
+			nahead = (unsigned long)(total - first - nframes);
+		// a failed read only leaves silence to look ahead into
+		ahead = (unsigned char*)get_chunk(jb, (first + nframes) * framebytes, nahead * framebytes, 0, jb->limitbuf);
+		if (ahead == NULL)
+			nahead = 0;
+	}
+
+	// the first chunk starts the limiter off on the frames it looks ahead to
+	if (first == 0)
+		limit_push(jb, 0, jb->lim.look, p, first, nframes, ahead, nahead, NULL);
+
+	for (i = 0; i < nframes; i += n) {
+		n = nframes - i;
+		if (n > KERNELBLOCK / jb->pwf.nchannels)
+			n = KERNELBLOCK / jb->pwf.nchannels;
+		limit_push(jb, first + i + jb->lim.look, first + i + n + jb->lim.look, p, first, nframes, ahead, nahead, gain);
+		load_scaled(jb, p + i * framebytes, x, n * jb->pwf.nchannels);
+		gain_frames_f64(x, gain, n, jb->pwf.nchannels);
+		store_limited(jb, x, p + i * framebytes, n * jb->pwf.nchannels);
+	}
+
+	if (ahead)
+		put_chunk(jb, ahead, (first + nframes) * framebytes, nahead * framebytes, 0);
+}
+
+// Pushes frames from to to - 1 into the limiter, taken from the chunk p
+// (frames first to first + nframes - 1), then from ahead (the nahead frames
+// after it), then silence. The gains of the frames lim.look frames back go
+// to gain (or nowhere if it is NULL).
+void limit_push(job *jb, unsigned long long from, unsigned long long to, unsigned char *p, unsigned long long first, unsigned long nframes, unsigned char *ahead, unsigned long nahead, double *gain) {
+	double			x[KERNELBLOCK];
+	unsigned long	framebytes = jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+	unsigned long	n;
+	unsigned long long	f, end;
+	unsigned char	*src;
+
+	for (f = from; f < to; f += n) {
+		if (f < first + nframes) {
+			src = p + (f - first) * framebytes;
+			end = first + nframes;
+		} else if (f < first + nframes + nahead) {
+			src = ahead + (f - first - nframes) * framebytes;
+			end = first + nframes + nahead;
+		} else {
+			src = NULL;
+			end = to;
+		}
+		if (end > to)
+			end = to;
+		n = (unsigned long)(end - f);
+		if (n > KERNELBLOCK / jb->pwf.nchannels)
+			n = KERNELBLOCK / jb->pwf.nchannels;
+
+		if (src)
+			load_scaled(jb, src, x, n * jb->pwf.nchannels);
+		limiter_push(&jb->lim, src ? x : NULL, n, gain ? gain + (f - from) : NULL);
+	}
+}
+
+// n samples of any format times ratio, as doubles (n never exceeds
+// KERNELBLOCK)
+void load_scaled(job *jb, void *src, double *dst, unsigned long n) {
+	unsigned char	*p8 = (unsigned char*)src;
+	short			*p16 = (short*)src;
+	int				block[KERNELBLOCK];
+	unsigned long	i;
+
+	if (jb->pwf.format == 3) {
+		if (jb->pwf.bitspersample == 32) {
+			for (i = 0; i < n; i++)
+				dst[i] = ((float*)src)[i] * jb->ratio;
+		} else {
+			for (i = 0; i < n; i++)
+				dst[i] = ((double*)src)[i] * jb->ratio;
+		}
+	} else if (jb->pwf.bitspersample == 8) {
+		for (i = 0; i < n; i++)
+			dst[i] = (signed char)(p8[i] ^ 0x80) * jb->ratio;
+	} else if (jb->pwf.bitspersample == 16) {
+		for (i = 0; i < n; i++)
+			dst[i] = p16[i] * jb->ratio;
+	} else {
+		unpack24(p8, block, n);
+		for (i = 0; i < n; i++)
+			dst[i] = block[i] * jb->ratio;
+	}
+}
+
+// Stores n limited samples in the file's format, truncated and clamped as
+// the gain kernels do (so that unlimited stretches come out just the same)
+void store_limited(job *jb, double *src, void *dst, unsigned long n) {
+	unsigned char	*p8 = (unsigned char*)dst;
+	short			*p16 = (short*)dst;
+	int				block[KERNELBLOCK];
+	double			limit = noclip ? HUGE_VAL : 1.0;
+	unsigned long	i;
+
+	if (jb->pwf.format == 3) {
+		for (i = 0; i < n; i++) {
+			src[i] = (src[i] < limit) ? src[i] : limit;
+			src[i] = (src[i] > -limit) ? src[i] : -limit;
+		}
+		if (jb->pwf.bitspersample == 32) {
+			for (i = 0; i < n; i++)
+				((float*)dst)[i] = (float)src[i];
+		} else
+			memcpy(dst, src, n * sizeof(double));
+	} else if (jb->pwf.bitspersample == 8) {
+		// as make_table8()
+		for (i = 0; i < n; i++)
+			p8[i] = (src[i] > 127.0) ? 0xFF : (src[i] < -127.0) ? 0x00 : (unsigned char)((int)src[i] + 128);
+	} else if (jb->pwf.bitspersample == 16) {
+		for (i = 0; i < n; i++)
+			p16[i] = (src[i] > 32767.0) ? 32767 : (src[i] < -32767.0) ? -32767 : (short)src[i];
+	} else {
+		for (i = 0; i < n; i++)
+			block[i] = (src[i] > 8388607.0) ? 8388607 : (src[i] < -8388607.0) ? -8388607 : (int)src[i];
+		pack24(block, p8, n);
+	}
+}
+
+// Runs kernel over the whole data chunk and stores the result (in place or
+// to the output file); a NULL kernel just copies the data. Returns the number
+// of bytes processed, or 0 on error.
+unsigned long long run_amplify(job *jb, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds)) {
+	unsigned long long	ndone = 0;
+	unsigned long	readn;
+	int				npercent, lastn = -1;
+	void			*chunk;
+	pipeline		pl;
+	dither_state	ds;
+
+	// long files are amplified in segments on several threads when asked to
+	// (the limiter has to see the chunks in order)
+	if ((jb->nthreads > 1) && !jb->limiting) {
+		switch (amplify_segments(jb, kernel)) {
+			case 0:
+				return 0;
+			case 1:
+				return jb->pwf.ndatabytes;
+		}
+	}
+
+	ds.next = 0;
+	if ((ds.err = (double*)calloc(jb->pwf.nchannels, sizeof(double))) == NULL) {
+		if (!quiet)
+			job_printf(jb, "Cannot allocate buffer in memory.\n");
+		return 0;
+	}
+
+	// Buffered I/O overlaps reading, amplifying and writing (mapped views
+	// are only used for in-place processing, see get_chunk())
+	if ((!use_mmap || nooverwrite) && pipeline_init(jb, &pl)) {
+		ndone = run_pipeline(jb, &pl, kernel, &ds);
+		free(ds.err);
+		return ndone;
+	}
+
+	while (ndone < jb->pwf.ndatabytes) {
+		readn = jb->chunksize;
+		if (readn > (jb->pwf.ndatabytes - ndone))
+			readn = (unsigned long)(jb->pwf.ndatabytes - ndone);
+
+		if ((chunk = get_chunk(jb, ndone, readn, 1, jb->buf)) == NULL) {
+			ndone = 0;
+			break;
+		}
+
+		if (kernel)
+			kernel(jb, chunk, readn, ndone, &ds);
+
+		if (!put_chunk(jb, chunk, ndone, readn, 1)) {
+			ndone = 0;
+			break;
+		}
+
+		ndone += readn;
+
+		if (!quiet && !jb->buffered) {
+			npercent = (int)(100.0 * ((double)ndone / (double)jb->pwf.ndatabytes));
+			if (npercent > lastn) {
+				job_printf(jb, "\r%d%%", npercent);
+				fflush(stderr);
+				lastn = npercent;
+			}
+		}
 	}
 
-	pcmwav_rewind(&pwf);
+	free(ds.err);
+	return ndone;
+}
+
+// Sets up the buffer ring for run_pipeline(); returns 1 if successful or 0
+// if the pipeline can't be used
+int pipeline_init(job *jb, pipeline *pl) {
+	int		i;
+
+	pl->jb = jb;
+	pl->slotsize = iobufsize - iobufsize % (jb->pwf.nchannels * (jb->pwf.bitspersample / 8));
+	pl->ring = (char*)VirtualAlloc(NULL, NPIPEBUFS * pl->slotsize, MEM_COMMIT, PAGE_READWRITE);
+	if (pl->ring == NULL)
+		return 0;
+
+	if (!semaphore_init(&pl->nfree, NPIPEBUFS)) {
+		VirtualFree(pl->ring, 0, MEM_RELEASE);
+		return 0;
+	}
+	if (!semaphore_init(&pl->nfilled, 0)) {
+		semaphore_free(&pl->nfree);
+		VirtualFree(pl->ring, 0, MEM_RELEASE);
+		return 0;
+	}
+	if (!semaphore_init(&pl->ncomputed, 0)) {
+		semaphore_free(&pl->nfilled);
+		semaphore_free(&pl->nfree);
+		VirtualFree(pl->ring, 0, MEM_RELEASE);
+		return 0;
+	}
+	for (i = 0; i < NPIPEBUFS; i++)
+		pl->slot[i].data = pl->ring + i * pl->slotsize;
 
-	*minpeak = minp;
-	*maxpeak = maxp;
+	pl->nchunks = (unsigned long)((jb->pwf.ndatabytes + pl->slotsize - 1) / pl->slotsize);
+	pl->error = 0;
 
 	return 1;
 }
 
-unsigned long amplify8(void) {
-	unsigned long	i, ndone = 0, readn;
-	long			nwr;
-	int				npercent, lastn = -1;
-	
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
+void pipeline_free(pipeline *pl) {
+	semaphore_free(&pl->ncomputed);
+	semaphore_free(&pl->nfilled);
+	semaphore_free(&pl->nfree);
+	VirtualFree(pl->ring, 0, MEM_RELEASE);
+}
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
-		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
-		return 0;
+// Flags an error and wakes up every stage so that they can bail out
+void pipeline_abort(pipeline *pl) {
+	int		i;
+
+	pl->error = 1;
+	for (i = 0; i < NPIPEBUFS; i++) {
+		semaphore_post(&pl->nfree);
+		semaphore_post(&pl->nfilled);
+		semaphore_post(&pl->ncomputed);
 	}
+}
 
-	while (readn) {
-		for (i = 0; i < readn; i++) {
-			buf8[i] = table8[(unsigned char)buf8[i]];
+// Reader stage: fills free ring slots with consecutive chunks
+void pipeline_reader(void *arg) {
+	pipeline		*pl = (pipeline*)arg;
+	job				*jb = pl->jb;
+	pipe_slot		*slot;
+	unsigned long	k;
+
+	for (k = 0; k < pl->nchunks; k++) {
+		semaphore_wait(&pl->nfree);
+		if (pl->error)
+			return;
+
+		slot = &pl->slot[k % NPIPEBUFS];
+		slot->pos = (unsigned long long)k * pl->slotsize;
+		slot->len = pl->slotsize;
+		if (slot->len > (jb->pwf.ndatabytes - slot->pos))
+			slot->len = (unsigned long)(jb->pwf.ndatabytes - slot->pos);
+
+		if (!pcmwav_read_at(&jb->pwf, slot->data, slot->len, slot->pos)) {
+			if (!quiet)
+				job_printf(jb, "%s\n", pcmwav_error);
+			pipeline_abort(pl);
+			return;
 		}
 
-		if (!nooverwrite) {
-			nwr = -((long)readn);
-			pcmwav_seek(&pwf, nwr);
-
-			if (!pcmwav_write(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
-		} else {
-			DWORD	nwritten;
-			WriteFile(outf, buf, readn, &nwritten, NULL);
-			if (nwritten != readn) {
-				if (!quiet)
-					fprintf(stderr, "Output file write error.\n");
-				return 0;
-			}
-		}
+		semaphore_post(&pl->nfilled);
+	}
+}
 
-		ndone += readn;
+// Writer stage: stores amplified slots and hands them back to the reader
+void pipeline_writer(void *arg) {
+	pipeline		*pl = (pipeline*)arg;
+	job				*jb = pl->jb;
+	pipe_slot		*slot;
+	unsigned long	k;
 
-		if (!quiet) {
-			npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
-			if (npercent > lastn) {
-				fprintf(stderr, "\r%d%%", npercent);
-				fflush(stderr);
-				lastn = npercent;
-			}
-		}
+	for (k = 0; k < pl->nchunks; k++) {
+		semaphore_wait(&pl->ncomputed);
+		if (pl->error)
+			return;
 
-		readn = iobufsize;
-		if (readn > (pwf.ndatabytes - ndone))
-			readn = pwf.ndatabytes - ndone;
+		slot = &pl->slot[k % NPIPEBUFS];
 
-		if (readn) {
-			if (!pcmwav_read(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
+		if (!pcmwav_write_at(nooverwrite ? &jb->outwf : &jb->pwf, slot->data, slot->len, slot->pos)) {
+			if (!quiet)
+				job_printf(jb, "%s\n", pcmwav_error);
+			pipeline_abort(pl);
+			return;
 		}
-		else
-			break;
-	}
 
-	return ndone;
+		semaphore_post(&pl->nfree);
+	}
 }
 
-unsigned long amplify16(void) {
-	unsigned long	i, ndone = 0, readn;
-	long			nwr;
+// Amplifies the data chunk with a reader thread, the calling thread running
+// kernel and a writer thread, rotating NPIPEBUFS buffers between them so that
+// disk I/O and computation overlap. Frees the pipeline; returns the number of
+// bytes processed, or 0 on error.
+unsigned long long run_pipeline(job *jb, pipeline *pl, void (*kernel)(job *jb, void *chunk, unsigned long len, unsigned long long pos, dither_state *ds), dither_state *ds) {
+	thread			reader, writer;
+	pipe_slot		*slot;
+	unsigned long	k;
+	unsigned long long	ndone = 0;
 	int				npercent, lastn = -1;
-	
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
+	if (!thread_start(&reader, pipeline_reader, pl)) {
+		pipeline_free(pl);
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
+			job_printf(jb, "Cannot start I/O thread.\n");
+		return 0;
+	}
+	if (!thread_start(&writer, pipeline_writer, pl)) {
+		pipeline_abort(pl);
+		thread_join(&reader);
+		pipeline_free(pl);
+		if (!quiet)
+			job_printf(jb, "Cannot start I/O thread.\n");
 		return 0;
 	}
 
-	while (readn) {
-		for (i = 0; i < (readn>>1); i++) {
-			buf16[i] = table16[buf16[i]];
-		}
+	for (k = 0; k < pl->nchunks; k++) {
+		semaphore_wait(&pl->nfilled);
+		if (pl->error)
+			break;
 
-		if (!nooverwrite) {
-			nwr = -((long)readn);
-			pcmwav_seek(&pwf, nwr);
-			
-			if (!pcmwav_write(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
-		} else {
-			DWORD nwritten;
-			WriteFile(outf, buf, readn, &nwritten, NULL);
-			if (nwritten != readn) {
-				if (!quiet)
-					fprintf(stderr, "Output file write error.\n");
-				return 0;
-			}
-		}
+		slot = &pl->slot[k % NPIPEBUFS];
+		if (kernel)
+			kernel(jb, slot->data, slot->len, slot->pos, ds);
 
-		ndone += readn;
+		// once posted, the slot may be refilled at any time
+		ndone += slot->len;
+		semaphore_post(&pl->ncomputed);
 
-		if (!quiet) {
-			npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
+		if (!quiet && !jb->buffered) {
+			npercent = (int)(100.0 * ((double)ndone / (double)jb->pwf.ndatabytes));
 			if (npercent > lastn) {
-				fprintf(stderr, "\r%d%%", npercent);
+				job_printf(jb, "\r%d%%", npercent);
 				fflush(stderr);
 				lastn = npercent;
 			}
 		}
+	}
 
-		readn = iobufsize;
-		if (readn > (pwf.ndatabytes - ndone))
-			readn = pwf.ndatabytes - ndone;
+	thread_join(&reader);
+	thread_join(&writer);
 
-		if (readn) {
-			if (!pcmwav_read(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
-		}
-		else
-			break;
-	}
+	if (pl->error)
+		ndone = 0;
+
+	pipeline_free(pl);
 
 	return ndone;
 }
 
-unsigned long passthrough(void) {
-	unsigned long	ndone = 0, readn;
-	int				npercent, lastn = -1;
-	
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
+// Returns a pointer to len data bytes at data offset pos. With -M this is a
+// view straight into the mapped data chunk; otherwise the bytes are read into
+// mem (buf, or a buffer of the calling thread). Set store if the chunk is
+// going to be modified and stored with put_chunk(); output to another file
+// then never uses a view, so that the input stays untouched. Returns NULL on
+// error.
+void *get_chunk(job *jb, unsigned long long pos, unsigned long len, int store, void *mem) {
+	void	*chunk;
+
+	if (use_mmap && !(store && nooverwrite)) {
+		if (!pcmwav_map(&jb->pwf, pos, len, &chunk)) {
+			if (!quiet)
+				job_printf(jb, "%s\n", pcmwav_error);
+			return NULL;
+		}
+		return chunk;
+	}
 
-	if (!pcmwav_read(&pwf, buf, readn)) {
+	if (!pcmwav_read_at(&jb->pwf, mem, len, pos)) {
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
-		return 0;
+			job_printf(jb, "%s\n", pcmwav_error);
+		return NULL;
 	}
 
-	while (readn) {
-		DWORD nwritten;
-		WriteFile(outf, buf, readn, &nwritten, NULL);
-		if (nwritten != readn) {
+	return mem;
+}
+
+// Releases a chunk returned by get_chunk(). If store is set, the chunk is
+// written to the output file, or back into the WAV file when overwriting
+// (mapped views are modified in place and need no write-back).
+int put_chunk(job *jb, void *chunk, unsigned long long pos, unsigned long len, int store) {
+	int		ret = 1;
+	int		mapped = use_mmap && !(store && nooverwrite);
+
+	if (store && !mapped) {
+		if (!pcmwav_write_at(nooverwrite ? &jb->outwf : &jb->pwf, chunk, len, pos)) {
 			if (!quiet)
-				fprintf(stderr, "Output file write error.\n");
-			return 0;
+				job_printf(jb, "%s\n", pcmwav_error);
+			ret = 0;
 		}
+	}
 
-		ndone += readn;
+	if (mapped)
+		pcmwav_unmap(&jb->pwf, chunk, pos, len);
 
-		if (!quiet) {
-			npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
-			if (npercent > lastn) {
-				fprintf(stderr, "\r%d%%", npercent);
-				fflush(stderr);
-				lastn = npercent;
-			}
-		}
+	return ret;
+}
 
-		readn = iobufsize;
-		if (readn > (pwf.ndatabytes - ndone))
-			readn = pwf.ndatabytes - ndone;
+// Sample converters for the loudness meter: n samples to doubles in -1..1
+void to_double8(void *src, double *dst, unsigned long n) {
+	unsigned char	*p = (unsigned char*)src;
+	unsigned long	i;
 
-		if (readn) {
-			if (!pcmwav_read(&pwf, buf, readn)) {
-				if (!quiet)
-					fprintf(stderr, "%s\n", pcmwav_error);
-				return 0;
-			}
-		}
-		else
-			break;
-	}
+	for (i = 0; i < n; i++)
+		dst[i] = (signed char)(p[i] ^ 0x80) / 128.0;
+}
 
-	return ndone;
+void to_double16(void *src, double *dst, unsigned long n) {
+	signed short	*p = (signed short*)src;
+	unsigned long	i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = p[i] / 32768.0;
 }
 
-// Comparison function for qsort (for LUFS gating)
-int compare_double(const void *a, const void *b) {
-	double diff = (*(double*)a - *(double*)b);
-	if (diff < 0) return -1;
-	if (diff > 0) return 1;
-	return 0;
+void to_double24(void *src, double *dst, unsigned long n) {
+	int				block[KERNELBLOCK];
+	unsigned long	i;
+
+	// n never exceeds LUFSBLOCK (== KERNELBLOCK)
+	unpack24((unsigned char*)src, block, n);
+	for (i = 0; i < n; i++)
+		dst[i] = block[i] / 8388608.0;
 }
 
-// Initialize K-weighting filters according to ITU-R BS.1770-4
-void init_k_weighting(k_weighting *kw, unsigned long samplerate) {
-	double f0, Q, K, Vh, Vb, a0;
-	double omega, cosw, sinw, alpha, beta;
-	
-	// Clear state
-	kw->shelf.z1 = kw->shelf.z2 = 0.0;
-	kw->highpass.z1 = kw->highpass.z2 = 0.0;
-	
-	// High-shelf filter (pre-filter stage 1)
-	// Fc = 1681.974 Hz, Gain = +4.0 dB, Q = 0.7071
-	f0 = 1681.974;
-	Q = 0.7071;
-	K = tan(3.141592653589793 * f0 / samplerate);
-	Vh = pow(10.0, 4.0 / 20.0);
-	Vb = pow(Vh, 0.4996667741545416);
-	
-	a0 = 1.0 + K / Q + K * K;
-	kw->shelf.b0 = (Vh + Vb * K / Q + K * K) / a0;
-	kw->shelf.b1 = 2.0 * (K * K - Vh) / a0;
-	kw->shelf.b2 = (Vh - Vb * K / Q + K * K) / a0;
-	kw->shelf.a1 = 2.0 * (K * K - 1.0) / a0;
-	kw->shelf.a2 = (1.0 - K / Q + K * K) / a0;
-	
-	// High-pass filter (RLB weighting stage 2)
-	// Fc = 38.13547 Hz, Q = 0.5
-	f0 = 38.13547;
-	Q = 0.5;
-	omega = 2.0 * 3.141592653589793 * f0 / samplerate;
-	cosw = cos(omega);
-	sinw = sin(omega);
-	alpha = sinw / (2.0 * Q);
-	
-	a0 = 1.0 + alpha;
-	kw->highpass.b0 = (1.0 + cosw) / 2.0 / a0;
-	kw->highpass.b1 = -(1.0 + cosw) / a0;
-	kw->highpass.b2 = (1.0 + cosw) / 2.0 / a0;
-	kw->highpass.a1 = -2.0 * cosw / a0;
-	kw->highpass.a2 = (1.0 - alpha) / a0;
+// Float samples are already in -1..1 and need no scaling
+void to_double_f32(void *src, double *dst, unsigned long n) {
+	float			*p = (float*)src;
+	unsigned long	i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = p[i];
 }
 
-// Apply K-weighting to a single sample using biquad filters
-double apply_k_weighting(k_weighting *kw, double sample) {
-	double out;
-	
-	// Apply high-shelf filter (Direct Form II Transposed)
-	out = kw->shelf.b0 * sample + kw->shelf.z1;
-	kw->shelf.z1 = kw->shelf.b1 * sample - kw->shelf.a1 * out + kw->shelf.z2;
-	kw->shelf.z2 = kw->shelf.b2 * sample - kw->shelf.a2 * out;
-	sample = out;
-	
-	// Apply high-pass filter (Direct Form II Transposed)
-	out = kw->highpass.b0 * sample + kw->highpass.z1;
-	kw->highpass.z1 = kw->highpass.b1 * sample - kw->highpass.a1 * out + kw->highpass.z2;
-	kw->highpass.z2 = kw->highpass.b2 * sample - kw->highpass.a2 * out;
-	
-	return out;
-}
-
-// Calculate LUFS for 8-bit audio with gating
-double calculate_lufs8(void) {
-	unsigned long block_samples, hop_samples, max_blocks, block_count = 0;
-	unsigned long i, j, readn, ndone = 0;
-	double *block_loudness;
-	k_weighting kw_left, kw_right;
-	int npercent, lastn = -1;
-	double integrated_loudness, gated_loudness;
-	unsigned long blocks_to_use, valid_blocks;
-	unsigned short nchannels = pwf.nchannels;
-	
-	// Calculate block parameters (400ms blocks, 100ms hop) - per channel
-	block_samples = (unsigned long)(pwf.samplerate * 0.4);
-	hop_samples = (unsigned long)(pwf.samplerate * 0.1);
-	max_blocks = (pwf.ndatabytes / (hop_samples * nchannels)) + 1;
-	
-	// Allocate memory for block loudness values
-	block_loudness = (double*)VirtualAlloc(NULL, sizeof(double) * max_blocks, MEM_COMMIT, PAGE_READWRITE);
-	if (block_loudness == NULL) {
-		if (!quiet)
-			fprintf(stderr, "Cannot allocate memory for LUFS calculation.\n");
-		return -70.0;
-	}
-	
-	// Initialize K-weighting filters (one per channel)
-	init_k_weighting(&kw_left, pwf.samplerate);
-	if (nchannels == 2)
-		init_k_weighting(&kw_right, pwf.samplerate);
-	
-	// Allocate sliding window buffers (one per channel)
-	double *window_left = (double*)VirtualAlloc(NULL, sizeof(double) * block_samples, MEM_COMMIT, PAGE_READWRITE);
-	double *window_right = (nchannels == 2) ? 
-		(double*)VirtualAlloc(NULL, sizeof(double) * block_samples, MEM_COMMIT, PAGE_READWRITE) : NULL;
-	
-	if (window_left == NULL || (nchannels == 2 && window_right == NULL)) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		if (window_left) VirtualFree(window_left, 0, MEM_RELEASE);
-		if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-		if (!quiet)
-			fprintf(stderr, "Cannot allocate memory for LUFS calculation.\n");
-		return -70.0;
-	}
-	
-	unsigned long window_pos = 0, samples_in_window = 0;
-	
-	// Read initial buffer
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
-	
-	if (!pcmwav_read(&pwf, buf, readn)) {
+void to_double_f64(void *src, double *dst, unsigned long n) {
+	memcpy(dst, src, n * sizeof(double));
+}
+
+// -S: normalizes standard input to standard output in a single pass. Every
+// frame leaves stream_ms after it came in, amplified by the AGC to bring
+// the short-term loudness to target_lufs and held under the -m level by
+// its limiter (see agc_push()), so nothing is ever buffered beyond that.
+int stream_normalize(job *jb) {
+	agc				a;
+	unsigned char	*buf, *obuf;
+	double			x[KERNELBLOCK], y[KERNELBLOCK];
+	unsigned long	framebytes, maxframes, have = 0, nframes, n, got, i;
+	unsigned long long	skip, left = 0, frames = 0;
+	int				eof = 0, err = 0;
+	double			scale;
+	void			(*convert)(void *src, double *dst, unsigned long n);
+
+	if (raw_input)
+		jb->pwf = raw_format;
+	if (!pcmwav_open_stdin(&jb->pwf, raw_input) || !pcmwav_create_stdout(&jb->pwf, &jb->outwf, raw_input)) {
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		VirtualFree(window_left, 0, MEM_RELEASE);
-		if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-		return -70.0;
-	}
-	
-	unsigned long buf_pos = 0;
-	
-	while (readn > 0 || samples_in_window >= block_samples) {
-		// Fill window with samples (interleaved for stereo)
-		while (buf_pos < readn && samples_in_window < block_samples) {
-			// Left channel (or mono)
-			signed char sample_left = buf8[buf_pos++] ^ 0x80;
-			double norm_left = sample_left / 128.0;
-			window_left[window_pos] = apply_k_weighting(&kw_left, norm_left);
-			
-			// Right channel (if stereo)
-			if (nchannels == 2) {
-				signed char sample_right = buf8[buf_pos++] ^ 0x80;
-				double norm_right = sample_right / 128.0;
-				window_right[window_pos] = apply_k_weighting(&kw_right, norm_right);
-			}
-			
-			window_pos++;
-			samples_in_window++;
-			if (window_pos >= block_samples) window_pos = 0;
-		}
-		
-		// Process complete block
-		if (samples_in_window >= block_samples) {
-			double sum_squares_left = 0.0, sum_squares_right = 0.0;
-			
-			// Calculate mean square per channel
-			for (i = 0; i < block_samples; i++) {
-				unsigned long idx = (window_pos + i) % block_samples;
-				sum_squares_left += window_left[idx] * window_left[idx];
-				if (nchannels == 2)
-					sum_squares_right += window_right[idx] * window_right[idx];
-			}
-			
-			// Average across channels (ITU-R BS.1770-4)
-			double mean_square;
-			if (nchannels == 2) {
-				mean_square = (sum_squares_left + sum_squares_right) / (2.0 * block_samples);
-			} else {
-				mean_square = sum_squares_left / block_samples;
-			}
-			
-			if (mean_square > 0.0) {
-				block_loudness[block_count++] = -0.691 + 10.0 * log10(mean_square);
-			} else {
-				block_loudness[block_count++] = -70.0;
-			}
-			
-			// Slide window by hop_samples
-			unsigned long to_skip = hop_samples;
-			while (to_skip > 0 && samples_in_window > 0) {
-				window_pos++;
-				if (window_pos >= block_samples) window_pos = 0;
-				samples_in_window--;
-				to_skip--;
-			}
-		}
-		
-		// Read more data if needed
-		if (buf_pos >= readn) {
-			ndone += readn;
-			
-			if (!quiet) {
-				npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
-				if (npercent > lastn) {
-					fprintf(stderr, "\rPass 1 (LUFS): %d%%", npercent);
-					fflush(stderr);
-					lastn = npercent;
-				}
-			}
-			
-			readn = iobufsize;
-			if (readn > (pwf.ndatabytes - ndone))
-				readn = pwf.ndatabytes - ndone;
-			
-			if (readn > 0) {
-				if (!pcmwav_read(&pwf, buf, readn)) {
-					if (!quiet)
-						fprintf(stderr, "%s\n", pcmwav_error);
-					VirtualFree(block_loudness, 0, MEM_RELEASE);
-					VirtualFree(window_left, 0, MEM_RELEASE);
-					if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-					return -70.0;
-				}
-				buf_pos = 0;
-			}
-		}
-		
-		if (readn == 0 && samples_in_window < block_samples)
-			break;
-	}
-	
-	VirtualFree(window_left, 0, MEM_RELEASE);
-	if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-	
-	if (block_count == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return -70.0;
-	}
-	
-	// Apply percentile gating if specified
-	if (gate_percentile < 100.0) {
-		qsort(block_loudness, block_count, sizeof(double), compare_double);
-		blocks_to_use = (unsigned long)(block_count * gate_percentile / 100.0);
-		if (blocks_to_use < 1) blocks_to_use = 1;
-		block_count = blocks_to_use;
-	}
-	
-	// Apply absolute gate (-70 LUFS)
-	double sum_loudness = 0.0;
-	valid_blocks = 0;
-	for (i = 0; i < block_count; i++) {
-		if (block_loudness[i] > -70.0) {
-			sum_loudness += pow(10.0, block_loudness[i] / 10.0);
-			valid_blocks++;
-		}
-	}
-	
-	if (valid_blocks == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return -70.0;
-	}
-	
-	double avg_loudness = -0.691 + 10.0 * log10(sum_loudness / valid_blocks);
-	
-	// Apply relative gate (-10 LU below average)
-	double relative_threshold = avg_loudness - 10.0;
-	sum_loudness = 0.0;
-	valid_blocks = 0;
-	
-	for (i = 0; i < block_count; i++) {
-		if (block_loudness[i] >= relative_threshold) {
-			sum_loudness += pow(10.0, block_loudness[i] / 10.0);
-			valid_blocks++;
-		}
-	}
-	
-	if (valid_blocks == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return avg_loudness;
+			job_printf(jb, "%s\n", pcmwav_error);
+		return 1;
 	}
-	
-	integrated_loudness = -0.691 + 10.0 * log10(sum_loudness / valid_blocks);
-	
-	VirtualFree(block_loudness, 0, MEM_RELEASE);
-	pcmwav_rewind(&pwf);
-	
-	return integrated_loudness;
-}
-
-// Calculate LUFS for 16-bit audio with gating
-double calculate_lufs16(void) {
-	unsigned long block_samples, hop_samples, max_blocks, block_count = 0;
-	unsigned long i, j, readn, ndone = 0;
-	double *block_loudness;
-	k_weighting kw_left, kw_right;
-	int npercent, lastn = -1;
-	double integrated_loudness, gated_loudness;
-	unsigned long blocks_to_use, valid_blocks;
-	unsigned short nchannels = pwf.nchannels;
-	
-	// Calculate block parameters (400ms blocks, 100ms hop) - per channel
-	block_samples = (unsigned long)(pwf.samplerate * 0.4);
-	hop_samples = (unsigned long)(pwf.samplerate * 0.1);
-	max_blocks = (pwf.ndatabytes / (hop_samples * 2 * nchannels)) + 1;
-	
-	// Allocate memory for block loudness values
-	block_loudness = (double*)VirtualAlloc(NULL, sizeof(double) * max_blocks, MEM_COMMIT, PAGE_READWRITE);
-	if (block_loudness == NULL) {
-		if (!quiet)
-			fprintf(stderr, "Cannot allocate memory for LUFS calculation.\n");
-		return -70.0;
+
+	if (jb->pwf.format == 3) {
+		convert = (jb->pwf.bitspersample == 32) ? to_double_f32 : to_double_f64;
+		scale = 1.0;
+	} else if (jb->pwf.bitspersample == 8) {
+		convert = to_double8;
+		scale = 128.0;
+	} else if (jb->pwf.bitspersample == 16) {
+		convert = to_double16;
+		scale = 32768.0;
+	} else {
+		convert = to_double24;
+		scale = 8388608.0;
 	}
-	
-	// Initialize K-weighting filters (one per channel)
-	init_k_weighting(&kw_left, pwf.samplerate);
-	if (nchannels == 2)
-		init_k_weighting(&kw_right, pwf.samplerate);
-	
-	// Allocate sliding window buffers (one per channel)
-	double *window_left = (double*)VirtualAlloc(NULL, sizeof(double) * block_samples, MEM_COMMIT, PAGE_READWRITE);
-	double *window_right = (nchannels == 2) ? 
-		(double*)VirtualAlloc(NULL, sizeof(double) * block_samples, MEM_COMMIT, PAGE_READWRITE) : NULL;
-	
-	if (window_left == NULL || (nchannels == 2 && window_right == NULL)) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		if (window_left) VirtualFree(window_left, 0, MEM_RELEASE);
-		if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
+
+	framebytes = jb->pwf.nchannels * (jb->pwf.bitspersample / 8);
+	maxframes = KERNELBLOCK / jb->pwf.nchannels;
+	if (maxframes == 0) {
 		if (!quiet)
-			fprintf(stderr, "Cannot allocate memory for LUFS calculation.\n");
-		return -70.0;
+			job_printf(jb, "Too many channels for LUFS measurement.\n");
+		return 2;
 	}
-	
-	unsigned long window_pos = 0, samples_in_window = 0;
-	
-	// Read initial buffer
-	readn = iobufsize;
-	if (pwf.ndatabytes < iobufsize)
-		readn = pwf.ndatabytes;
-	
-	if (!pcmwav_read(&pwf, buf, readn)) {
+
+	buf = (unsigned char*)VirtualAlloc(NULL, 2 * maxframes * framebytes, MEM_COMMIT, PAGE_READWRITE);
+	if ((buf == NULL) || !agc_init(&a, jb->pwf.samplerate, jb->pwf.nchannels, jb->pwf.channelmask,
+			(unsigned long)((unsigned long long)jb->pwf.samplerate * stream_ms / 1000), target_lufs,
+			full_scale(jb) / scale * normpercent / 100.0, truepeak_mode)) {
 		if (!quiet)
-			fprintf(stderr, "%s\n", pcmwav_error);
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		VirtualFree(window_left, 0, MEM_RELEASE);
-		if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-		return -70.0;
+			job_printf(jb, "Cannot allocate memory for the stream.\n");
+		if (buf)
+			VirtualFree(buf, 0, MEM_RELEASE);
+		return 4;
 	}
-	
-	unsigned long buf_pos = 0;
-	
-	while (readn > 0 || samples_in_window >= block_samples) {
-		// Fill window with samples (interleaved for stereo)
-		while (buf_pos < (readn >> 1) && samples_in_window < block_samples) {
-			// Left channel (or mono)
-			signed short sample_left = buf16[buf_pos++];
-			double norm_left = sample_left / 32768.0;
-			window_left[window_pos] = apply_k_weighting(&kw_left, norm_left);
-			
-			// Right channel (if stereo)
-			if (nchannels == 2) {
-				signed short sample_right = buf16[buf_pos++];
-				double norm_right = sample_right / 32768.0;
-				window_right[window_pos] = apply_k_weighting(&kw_right, norm_right);
-			}
-			
-			window_pos++;
-			samples_in_window++;
-			if (window_pos >= block_samples) window_pos = 0;
-		}
-		
-		// Process complete block
-		if (samples_in_window >= block_samples) {
-			double sum_squares_left = 0.0, sum_squares_right = 0.0;
-			
-			// Calculate mean square per channel
-			for (i = 0; i < block_samples; i++) {
-				unsigned long idx = (window_pos + i) % block_samples;
-				sum_squares_left += window_left[idx] * window_left[idx];
-				if (nchannels == 2)
-					sum_squares_right += window_right[idx] * window_right[idx];
-			}
-			
-			// Average across channels (ITU-R BS.1770-4)
-			double mean_square;
-			if (nchannels == 2) {
-				mean_square = (sum_squares_left + sum_squares_right) / (2.0 * block_samples);
-			} else {
-				mean_square = sum_squares_left / block_samples;
-			}
-			
-			if (mean_square > 0.0) {
-				block_loudness[block_count++] = -0.691 + 10.0 * log10(mean_square);
-			} else {
-				block_loudness[block_count++] = -70.0;
-			}
-			
-			// Slide window by hop_samples
-			unsigned long to_skip = hop_samples;
-			while (to_skip > 0 && samples_in_window > 0) {
-				window_pos++;
-				if (window_pos >= block_samples) window_pos = 0;
-				samples_in_window--;
-				to_skip--;
+	obuf = buf + maxframes * framebytes;
+	skip = a.delay;
+
+	if (!quiet)
+		job_printf(jb, "Streaming to %.1f LUFS with %d ms latency...\n", target_lufs, stream_ms);
+
+	for (;;) {
+		if (!eof) {
+			// whatever the pipe has, in whole frames
+			got = pcmwav_read_stream(&jb->pwf, buf + have, maxframes * framebytes - have);
+			if (got == 0) {
+				// the last frames still in the AGC come out with silence
+				eof = 1;
+				left = a.delay;
+				continue;
 			}
+			have += got;
+			nframes = have / framebytes;
+			if (nframes == 0)
+				continue;
+			convert(buf, x, nframes * jb->pwf.nchannels);
+			agc_push(&a, x, nframes, y);
+			have -= nframes * framebytes;
+			memmove(buf, buf + nframes * framebytes, have);
+		} else {
+			if (left == 0)
+				break;
+			nframes = (left > maxframes) ? maxframes : (unsigned long)left;
+			left -= nframes;
+			agc_push(&a, NULL, nframes, y);
 		}
-		
-		// Read more data if needed
-		if (buf_pos >= (readn >> 1)) {
-			ndone += readn;
-			
-			if (!quiet) {
-				npercent = (int)(100.0 * ((double)ndone / (double)pwf.ndatabytes));
-				if (npercent > lastn) {
-					fprintf(stderr, "\rPass 1 (LUFS): %d%%", npercent);
-					fflush(stderr);
-					lastn = npercent;
-				}
-			}
-			
-			readn = iobufsize;
-			if (readn > (pwf.ndatabytes - ndone))
-				readn = pwf.ndatabytes - ndone;
-			
-			if (readn > 0) {
-				if (!pcmwav_read(&pwf, buf, readn)) {
-					if (!quiet)
-						fprintf(stderr, "%s\n", pcmwav_error);
-					VirtualFree(block_loudness, 0, MEM_RELEASE);
-					VirtualFree(window_left, 0, MEM_RELEASE);
-					if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-					return -70.0;
-				}
-				buf_pos = 0;
-			}
+
+		// the first frames out come from before the audio started
+		n = 0;
+		if (skip) {
+			n = (skip > nframes) ? nframes : (unsigned long)skip;
+			skip -= n;
 		}
-		
-		if (readn == 0 && samples_in_window < block_samples)
+		if (n == nframes)
+			continue;
+
+		frames += nframes - n;
+		for (i = n * jb->pwf.nchannels; i < nframes * jb->pwf.nchannels; i++)
+			y[i] *= scale;
+		store_limited(jb, y + n * jb->pwf.nchannels, obuf, (nframes - n) * jb->pwf.nchannels);
+		if (!pcmwav_write_stream(&jb->outwf, obuf, (nframes - n) * framebytes)) {
+			if (!quiet)
+				job_printf(jb, "%s\n", pcmwav_error);
+			err = 1;
 			break;
-	}
-	
-	VirtualFree(window_left, 0, MEM_RELEASE);
-	if (window_right) VirtualFree(window_right, 0, MEM_RELEASE);
-	
-	if (block_count == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return -70.0;
-	}
-	
-	// Apply percentile gating if specified
-	if (gate_percentile < 100.0) {
-		qsort(block_loudness, block_count, sizeof(double), compare_double);
-		blocks_to_use = (unsigned long)(block_count * gate_percentile / 100.0);
-		if (blocks_to_use < 1) blocks_to_use = 1;
-		block_count = blocks_to_use;
-	}
-	
-	// Apply absolute gate (-70 LUFS)
-	double sum_loudness = 0.0;
-	valid_blocks = 0;
-	for (i = 0; i < block_count; i++) {
-		if (block_loudness[i] > -70.0) {
-			sum_loudness += pow(10.0, block_loudness[i] / 10.0);
-			valid_blocks++;
-		}
-	}
-	
-	if (valid_blocks == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return -70.0;
-	}
-	
-	double avg_loudness = -0.691 + 10.0 * log10(sum_loudness / valid_blocks);
-	
-	// Apply relative gate (-10 LU below average)
-	double relative_threshold = avg_loudness - 10.0;
-	sum_loudness = 0.0;
-	valid_blocks = 0;
-	
-	for (i = 0; i < block_count; i++) {
-		if (block_loudness[i] >= relative_threshold) {
-			sum_loudness += pow(10.0, block_loudness[i] / 10.0);
-			valid_blocks++;
 		}
 	}
-	
-	if (valid_blocks == 0) {
-		VirtualFree(block_loudness, 0, MEM_RELEASE);
-		return avg_loudness;
+
+	if (!quiet) {
+		job_printf(jb, "Done: %.1f s streamed, input loudness %.1f LUFS.\n",
+			(double)frames / jb->pwf.samplerate, lufs_integrated(&a.meter, gate_percentile));
+		job_printf(jb, "AGC gain %.1f to %.1f dB, limiter gain reduction up to %.1f dB\n",
+			20.0 * log10(a.lowest), 20.0 * log10(a.highest), 20.0 * log10(1.0 / a.lim.lowest));
 	}
-	
-	integrated_loudness = -0.691 + 10.0 * log10(sum_loudness / valid_blocks);
-	
-	VirtualFree(block_loudness, 0, MEM_RELEASE);
-	pcmwav_rewind(&pwf);
-	
-	return integrated_loudness;
+
+	agc_free(&a);
+	VirtualFree(buf, 0, MEM_RELEASE);
+	pcmwav_close(&jb->pwf);
+	pcmwav_close(&jb->outwf);
+
+	return err;
 }
 
+#ifdef _WIN32
 // Check if file is completely written and ready to process
 int is_file_ready(char *filepath) {
 	HANDLE hFile;
@@ -1515,7 +3011,7 @@ int move_file_to_output(char *srcpath, char *outfolder) {
 }
 
 // Process all existing WAV files in the folder
-void process_existing_files(char *folder, char *outfolder) {
+void process_existing_files(job *jb, char *folder, char *outfolder) {
 	char search_path[_MAX_PATH];
 	char fullpath[_MAX_PATH];
 	char filename[_MAX_PATH];
@@ -1545,7 +3041,7 @@ void process_existing_files(char *folder, char *outfolder) {
 				fprintf(stderr, "Processing: %s\n", filename);
 			
 			// Process the file
-			result = process_file(fullpath);
+			result = process_file(jb, fullpath);
 			
 			if (result == 0 || result == 3) {
 				// Success or no amplification needed
@@ -1571,7 +3067,7 @@ void process_existing_files(char *folder, char *outfolder) {
 }
 
 // Watch folder for new WAV files and process them
-int watch_folder_mode(char *folder, char *outfolder) {
+int watch_folder_mode(job *jb, char *folder, char *outfolder) {
 	HANDLE hDir;
 	char buffer[4096];
 	DWORD bytesReturned;
@@ -1605,7 +3101,7 @@ int watch_folder_mode(char *folder, char *outfolder) {
 	// Process any existing files first
 	if (!quiet)
 		fprintf(stderr, "Checking for existing files in folder...\n");
-	process_existing_files(folder, outfolder);
+	process_existing_files(jb, folder, outfolder);
 	
 	// Main watch loop
 	while (1) {
@@ -1654,7 +3150,7 @@ int watch_folder_mode(char *folder, char *outfolder) {
 								fprintf(stderr, "Processing: %s\n", filename);
 							
 							// Process the file
-							int result = process_file(fullpath);
+							int result = process_file(jb, fullpath);
 							
 							if (result == 0 || result == 3) {
 								// Success or no amplification needed
@@ -1686,7 +3182,7 @@ next_notification:
 			
 			// After processing all events, check for any remaining files
 			// This catches files that may have been missed by the event notification
-			process_existing_files(folder, outfolder);
+			process_existing_files(jb, folder, outfolder);
 			
 		} else {
 			fprintf(stderr, "Error monitoring directory. Aborting.\n");
@@ -1698,6 +3194,13 @@ next_notification:
 	CloseHandle(hDir);
 	return 0;
 }
+#else
+// Watch mode relies on ReadDirectoryChangesW
+int watch_folder_mode(job *jb, char *folder, char *outfolder) {
+	fprintf(stderr, "Error: Watch mode is only available on Windows.\n");
+	return 2;
+}
+#endif
 
 void usage(void) {
 	fprintf(stderr, "\n%s\nVisit http://neon1.net/ for updates.\n\n", COPYRIGHT_NOTICE);	
@@ -1708,12 +3211,33 @@ void usage(void) {
 		"        -a <level>   don't find peaks; amplify by <level> (given in dB)\n"
 		"        -L <lufs>    normalize to target LUFS loudness (e.g. -14 for Spotify)\n"
 		"        -g <percent> gate percentile for LUFS: ignore loudest blocks (50-100%%)\n"
-		"        -m <percent> normalize to <percent> % (default 100)\n"
+		"        -m <percent> normalize to <percent> %% (default 100)\n"
 		"        -s <percent> smartpeak: count as a peak only a signal that has the\n"
 		"                     given percentile (50%%-100%%)\n"
 		"        -x <level>   abort if gain increase is smaller than <level> (in dB)\n"
 		"        -p           prompt before starting normalization\n"
 		"        -b <size>    specify I/O buffer size (in KB; 16..16384; default 64)\n"
+		"        -M           use memory-mapped I/O (no buffer copies or seeks)\n"
+		"        -j <threads> process long files on <threads> threads (1..64); with\n"
+		"                     several files, process <threads> of them at once\n"
+		"        -c           cache analysis results in <file>.ncache, so that reruns\n"
+		"                     with other targets don't measure the file again\n"
+		"        -e <percent> estimate the peaks or loudness from regions covering\n"
+		"                     <percent> %% of the file; with -x, files whose estimate\n"
+		"                     is too close to the threshold are measured in full, and\n"
+		"                     so are files to be amplified by a gain the peaks limit\n"
+		"                     (peak mode, -L with -m or -t) unless -r holds the peaks\n"
+		"        -u           amplify 16-bit files through a lookup table (as before)\n"
+		"        -D           dither: TPDF dither and noise shaping when rounding integer samples\n"
+		"        -r           with -L: keep the gain and hold the peaks at the -m level\n"
+		"                     with a 5 ms lookahead limiter (instead of lowering the gain)\n"
+		"        -t           true peak: limit to 4x oversampled peaks (dBTP) instead of\n"
+		"                     sample peaks; with -L, keeps them below the -m level\n"
+		"        -f           float files: keep peaks above 0 dBFS instead of clipping\n"
+		"        -S <ms>      stream: normalize standard input to standard output in one\n"
+		"                     pass (with -L), each frame coming out <ms> ms after it went in\n"
+		"        -i <format>  with -S: the input is raw samples, <rate>:<channels>:<bits>\n"
+		"                     (bits 8, 16, 24, or 32/64 for float); so is the output\n"
 		"        -o <file>    write output to <file> (instead of overwriting original)\n"
 		"        -w <folder>  watch mode: monitor folder for new WAV files\n"
 		"        -O <folder>  output folder for watch mode (required with -w)\n"
@@ -1731,12 +3255,16 @@ void usage(void) {
 		"        normalize -L -16 -g 95 *.wav    # Ignore loudest 5%% of blocks\n"
 		"        normalize -L -14 -m 98 *.wav    # LUFS with peak limiting\n\n"
 		
+		"    Stream examples:\n"
+		"        ffmpeg -i live.sdp -f wav - | normalize -L -16 -S 3000 > out.wav\n"
+		"        normalize -L -23 -S 1500 -i 48000:2:16 < in.raw > out.raw\n\n"
+
 		"    Watch mode examples:\n"
 		"        normalize -L -14 -m 99 -w C:\\incoming -O C:\\processed\n"
 		"        normalize -m 95 -w \"Drop Files Here\" -O \"Done\"\n"
 		"        normalize -L -16 -g 95 -w input -O output -q\n\n"
 		
 		"	- wildcards are allowed in 'input-file' (e.g. normalize *.wav)\n"
-		"	- 'input-file' needs to be a PCM WAV file.\n"
+		"	- 'input-file' needs to be an 8, 16 or 24-bit PCM or a 32/64-bit float WAV file.\n"
 		"	- watch mode runs continuously until stopped with Ctrl+C\n");
 }